@@ -27,11 +27,131 @@ Data types
     strings, and lists are linked lists of 0 or more values. The empty
     list is a NULL pointer.
 
+    Short symbol names (up to LIZP_INLINE_CHARS bytes) are stored inside
+    the value itself. Longer names are interned: all symbols with the same
+    long name point to one shared, immutable string. Either way, comparing
+    two symbols never needs a string compare.
+
     Symbols can additionally be interpretted as more data types if you wish,
     but you would have to provide the parsing functions to convert a string
     into the desired data type. In this header file, the valAsInteger() function
     is an example of this.
 
+    Symbols that are written as plain decimal integers (like "12" or "-7",
+    without a plus sign or leading zeros) are stored as native integers of
+    kind VK_INT instead of as strings. They still count as symbols. Because
+    of this and the inline short names, use valSymbolName() rather than the
+    `symbol` field to get the name of any symbol.
+
+    Errors are lists of the form [error ...] that are made by
+    valCreateError(). They carry a flag, so valIsError() is a single tag
+    test, and a list that only looks like an error is plain data. Common
+    errors such as running out of memory are made once by lizpRegisterCore()
+    and shared afterwards.
+
+Reading
+
+    valReadOneFromBuffer() parses a value from text that is all in memory.
+    To parse a stream instead, give a LizpReader each chunk of input with
+    lizpReaderFeed(), and take the values out with lizpReaderNext() until
+    it returns 0. Chunks may end anywhere, even inside of a symbol or a
+    comment. Call lizpReaderEnd() after the last chunk.
+
+    Neither keeps the text on the call stack, so deeply nested lists are
+    fine up to the reader's max_depth, which is LIZP_READ_DEPTH unless it is
+    changed. Deeper lists are an error.
+
+    Only the reader works without recursion, though. valFreeRec(),
+    valCopy(), valIsEqual() and valWriteToBuffer() recurse once per level
+    of nesting, so keep max_depth low enough that the C stack can hold that
+    many of their calls. Each takes up to about 200 bytes of stack per
+    level, so LIZP_READ_DEPTH needs about 2 MiB.
+
+    lizpMapFile() maps a whole regular file into memory to read it without
+    a copy. It needs mmap(), which is used if _POSIX_C_SOURCE is defined
+    before any header is included. Otherwise, and for pipes and empty
+    files, it returns NULL and the file has to be read as usual.
+
+    On x86 the reader looks for the end of symbols, quoted symbols and
+    comments 16 or 32 characters at a time with SSE2 or AVX2, whichever the
+    CPU has. Define LIZP_NO_SIMD to read one character at a time.
+
+Memory
+
+    Values come from a slab heap that grows in large chunks as needed. Call
+    lizpHeapTrim() at a convenient time (such as after a big evaluation) to
+    release the chunks that no longer hold any values.
+
+    Each value is 16 bytes. The kind of a value lives in a type map at the
+    start of its chunk rather than in the value, so always use valKind().
+
+    Once lizpRegisterCore() has run, the symbol #t and the integers from
+    LIZP_SMALL_INT_MIN to LIZP_SMALL_INT_MAX are constants: creating them
+    returns a preallocated value, and freeing them does nothing.
+
+    Between lizpArenaBegin() and lizpArenaEnd(), new values are
+    bump-allocated from an arena instead, freeing them does
+    nothing, and lizpArenaEnd() releases all of them at once. Values stored
+    into the outermost scope of an environment are copied out of the arena,
+    so they stay valid. Nothing else created in arena mode may be used after
+    lizpArenaEnd().
+
+    Evaluation shares values instead of copying them where it can, for
+    example when it looks up a variable. Shared values are reference
+    counted, so freeing them as usual is fine, but they must be treated as
+    read-only: use valCopy() to get a private copy of a list to modify.
+
+    After lizpGcEnable(), values are managed by a tracing garbage collector
+    instead: valFree() and valFreeRec() do nothing, evaluation shares
+    structure instead of copying it, and unreachable values are reclaimed by
+    lizpGcCollect(). Collection also happens automatically when evaluate()
+    is entered and enough values were allocated since the last collection.
+    Only values reachable from the root stack survive a collection, so push
+    the environment and anything else in use with lizpRootPush() before
+    evaluating.
+
+Scoping
+
+    Lambdas are lexically scoped. When a lambda is created, the variable
+    references in its body are resolved ahead of time: its parameters and
+    `let` variables become frame and slot numbers, variables of enclosing
+    lambdas and `let`s are captured by value, and globals refer straight to
+    their bindings. A resolved reference still prints as the variable name.
+    Names that are not bound yet are looked up among the globals when they
+    are evaluated, so a lambda never sees the variables of its caller. A
+    lambda that a `let` binds sees itself by that name, so that it can call
+    itself: [let [f [^ [n] [if [= n 0] 0 [f [- n 1]]]]] [f 3]].
+    A lambda is a VK_CLOSURE value holding its parameters and its resolved
+    body, and it prints as [lambda params body].
+
+    After lizpVmEnable(), lambda bodies are compiled to bytecode for a stack
+    machine instead, when the lambdas are created. Calls from one compiled
+    lambda to another stay inside of the machine. A compiled body still
+    prints as its source.
+
+    Native functions are registered with EnvSetFunc() and an argument form,
+    which is compiled into a LizpSignature once and checked before every
+    call. The compiler skips the check for calls whose arguments it can
+    prove to match, which are those with literal or untyped arguments.
+    Functions registered with EnvSetFuncV() instead get their arguments as
+    an array (argc, argv), which the evaluator fills without building a
+    list; the core arithmetic, comparison and list functions are these.
+    They may also take over their arguments, so `prepend` and `append`
+    reuse the nodes of a list that nothing else refers to instead of
+    copying it. A compiled tail call moves the variables that it uses only
+    once out of the frame, so a list that is built up in a loop stays
+    unshared.
+
+    Calls in tail position (the last expression of a lambda body, `do`,
+    `let`, `and` and `or`, or a branch of `if` and `cond`) reuse the
+    caller's frame, so loops written as recursion run in constant stack.
+
+    EnvSet() replaces the value of a variable that is bound in the scope
+    already, instead of shadowing it, so redefining a global does not grow
+    the environment. [set! sym expr] changes the nearest binding of a
+    variable the same way. Captured variables are copies, so a lambda
+    cannot change them with set!.
+
 */
 
 #ifndef _lizp_h_
@@ -40,12 +160,18 @@ Data types
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 
 struct Val;
+struct LizpScope;
+struct LizpBinding;
+struct LizpCode;
+struct LizpClosure;
 
 
 typedef struct Val *LizpFunc(struct Val *args);
+typedef struct Val *LizpFuncV(int argc, struct Val **argv);
 typedef struct Val *LizpMacro(struct Val *args, struct Val *env);
 
 
@@ -55,35 +181,119 @@ typedef enum ValKind {
     VK_LIST,
     VK_FUNC,
     VK_MACRO,
+    VK_INT,
+    VK_SCOPE,
+    VK_LOCAL,       // reference to a variable of a lambda's own frames
+    VK_CAPTURED,    // reference to a variable captured by a lambda
+    VK_GLOBAL,      // reference to a global variable
+    VK_CODE,        // compiled lambda body
+    VK_CLOSURE,     // lambda
 } ValKind;
 
 
+// longest symbol name that is stored inside of a Val
+#define LIZP_INLINE_CHARS 15
+
+
+// most positional arguments in the form of a native function
+#define LIZP_SIG_ARGS 5
+
+
+// Argument form of a native function, compiled from a form string (see
+// argsIsMatchForm) when the function is put into an environment
+typedef struct LizpSignature {
+    unsigned char min;              // number of required arguments
+    unsigned char count;            // number of positional arguments
+    char types[LIZP_SIG_ARGS + 1];  // type of each positional argument, then
+                                    // of the rest of the arguments, or 0
+} LizpSignature;
+
+
+// A value is 16 bytes, the size of a list node. Its kind is not stored in
+// the Val itself but in a type map of the chunk of memory that holds it, so
+// use valKind() and friends to get it.
 typedef struct Val {
-    ValKind kind;
     union {
         char *symbol;
-        LizpFunc *func;
+        char name[LIZP_INLINE_CHARS + 1];
+        long integer;
+        struct {
+            union {
+                LizpFunc *func;
+                LizpFuncV *funcv; // if the VF_VECTOR flag is set
+            };
+            LizpSignature sig;
+        };
         LizpMacro *macro;
+        struct LizpScope *scope;
+        struct LizpCode *code;
+        struct LizpClosure *closure;
         struct {
             struct Val *first;
             struct Val *rest;
         };
+        struct {
+            struct Val *var; // name of the variable that is referred to
+            union {
+                struct { unsigned depth, slot; };   // VK_LOCAL
+                struct Val *value;                  // VK_CAPTURED
+                struct LizpBinding *cell;           // VK_GLOBAL
+            };
+        };
     };
 } Val;
 
 
+// buffer size that is enough for the name of any integer symbol
+#define LIZP_INT_CHARS 24
+
+
+// default limit on how deeply the lists that are read may be nested
+#ifndef LIZP_READ_DEPTH
+#define LIZP_READ_DEPTH 10000
+#endif
+
+
+// Incremental reader state, see lizpReaderNext()
+typedef struct LizpReader {
+    const char *input;  // chunk of input being read
+    size_t length;
+    size_t pos;         // position in the chunk
+    bool end;           // no input follows the chunk
+    Val *hold;          // its first item is the value being read
+    Val ***tails;       // where the next item of each open list goes
+    size_t depth;       // number of open lists
+    size_t capacity;
+    size_t max_depth;   // most open lists allowed, LIZP_READ_DEPTH by default
+                        // (see "Reading" about raising it)
+    unsigned comment;   // nesting level of ( ) comments
+    unsigned char state;// what kind of token is being read
+    char *token;        // start of a token that was cut off by a chunk's end
+    size_t token_length;
+    size_t token_capacity;
+} LizpReader;
+
+
 // memory management
 Val *valAlloc(void);
 Val *valAllocKind(ValKind k);
 Val *valCopy(const Val *p);
 void valFree(Val *p);
 void valFreeRec(Val *p);
+size_t lizpHeapTrim(void);
+void lizpArenaBegin(void);
+void lizpArenaEnd(void);
+void lizpGcEnable(void);
+size_t lizpGcCollect(void);
+void lizpRootPush(Val *v);
+void lizpRootPop(size_t n);
+void lizpVmEnable(void);
 
 // value creation
 Val *valCreateInteger(long n);
 Val *valCreateList(Val *first, Val *rest);
 Val *valCreateSymbol(char *string);
-Val *valCreateSymbolCopy(const char *start, unsigned len);
+Val *valCreateSymbolCopy(const char *start, size_t len);
 Val *valCreateSymbolStr(const char *string);
 
 // value type checking
@@ -91,6 +301,7 @@ ValKind valKind(const Val *v);
 bool valIsInteger(const Val *v);
 bool valIsList(const Val *v);
 bool valIsSymbol(const Val *v);
+const char *valSymbolName(const Val *v, char buf[LIZP_INT_CHARS]);
 bool valIsFunc(const Val *v);
 bool valIsMacro(const Val *v);
 bool argsIsMatchForm(const char *form, const Val *args, Val **err);
@@ -106,9 +317,16 @@ bool valListLengthIsMoreThan(const Val *l, unsigned n);
 bool valListLengthIsLessThan(const Val *l, unsigned n);
 
 // value serialization
-unsigned valReadOneFromBuffer(const char *start, unsigned length, Val **out);
-unsigned valReadAllFromBuffer(const char *start, unsigned length, Val **out);
-unsigned valWriteToBuffer(const Val *p, char *out, unsigned length, bool readable);
+size_t valReadOneFromBuffer(const char *start, size_t length, Val **out);
+size_t valReadAllFromBuffer(const char *start, size_t length, Val **out);
+bool lizpReaderInit(LizpReader *r);
+void lizpReaderFeed(LizpReader *r, const char *input, size_t length);
+void lizpReaderEnd(LizpReader *r);
+bool lizpReaderNext(LizpReader *r, Val **out);
+void lizpReaderFree(LizpReader *r);
+const char *lizpMapFile(FILE *f, size_t *length_out);
+void lizpUnmapFile(const char *text, size_t length);
+size_t valWriteToBuffer(const Val *p, char *out, size_t length, bool readable);
 char *valWriteToNewString(const Val *p, bool readable);
 
 Val *valCreateTrue(void);
@@ -123,53 +341,55 @@ bool valIsTrue(const Val *v);
 Val *evaluate(const Val *ast, Val *env);
 Val *evaluateList(Val *list, Val *env);
 bool EnvGet(Val *env, const Val *key, Val **out);
+Val *EnvGlobal(Val *env);
 bool EnvSet(Val *env, Val *key, Val *val);
 bool EnvSet_const(Val *env, const Val *key, const Val *val);
-bool EnvSetFunc(Val *env, const char *name, LizpFunc *func);
+bool EnvSetFunc(Val *env, const char *name, const char *form, LizpFunc *func);
+bool EnvSetFuncV(Val *env, const char *name, const char *form, LizpFuncV *func);
 bool EnvSetMacro(Val *env, const char *name, LizpMacro *macro);
 bool EnvSetSym(Val *env, const char *symbol, Val *val);
 void EnvPop(Val *env);
-void EnvPush(Val *env);
+bool EnvPush(Val *env);
 
 void lizpRegisterCore(Val *env);
 Val *reverse_func(Val *args);    // [reverse list] reverse a list
 Val *concat_func(Val *args);     // [concat list.1 (list.N)...] concatenate lists together
 Val *join_func(Val *args);       // [join separator (list)...] join together each list with the separator list in between
-Val *without_func(Val *args);    // [without item list] remove all occurrences of item from the list
+Val *without_func(int argc, Val **argv);    // [without item list] remove all occurrences of item from the list
 Val *replace_func(Val *args);    // [replace item1 item2 list] replace all occurrences of item1 in list with item2
 Val *replace1_func(Val *args);   // [replaceN item1 item2 list n] replace up to n of item1 with item2 in list
 Val *replaceI_func(Val *args);   // [replaceI index item list] replace element in list at index with item
 Val *zip_func(Val *args);        // [zip list.1 (list.N)...]
-Val *append_func(Val *args);     // [append val list]
-Val *prepend_func(Val *args);    // [prepend val list]
+Val *append_func(int argc, Val **argv);     // [append val list]
+Val *prepend_func(int argc, Val **argv);    // [prepend val list]
 Val *print_func(Val *args);      // [print (v)...]
-Val *plus_func(Val *args);       // [+ integers...] sum
-Val *multiply_func(Val *args);   // [* integers...] product
-Val *subtract_func(Val *args);   // [- x (y)] subtraction
-Val *divide_func(Val *args);     // [/ x y] division
-Val *mod_func(Val *args);        // [% x y] modulo
-Val *equal_func(Val *args);      // [= x y (expr)...] check equality
+Val *plus_func(int argc, Val **argv);       // [+ integers...] sum
+Val *multiply_func(int argc, Val **argv);   // [* integers...] product
+Val *subtract_func(int argc, Val **argv);   // [- x (y)] subtraction
+Val *divide_func(int argc, Val **argv);     // [/ x y] division
+Val *mod_func(int argc, Val **argv);        // [% x y] modulo
+Val *equal_func(int argc, Val **argv);      // [= x y (expr)...] check equality
 Val *not_func(Val *args);        // [not expr] boolean not
 Val *symbol_q_func(Val *args);   // [symbol? val] check if value is a symbol
 Val *integer_q_func(Val *args);  // [integer? val] check if value is a integer symbol
 Val *list_q_func(Val *args);     // [list? val] check if value is a list
 Val *empty_q_func(Val *args);    // [empty? val] check if value is a the empty list
-Val *nth_func(Val *args);        // [nth index list] get the nth item in a list
-Val *list_func(Val *args);       // [list (val)...] create list from arguments (variadic)
-Val *length_func(Val *args);     // [length list]
+Val *nth_func(int argc, Val **argv);        // [nth index list] get the nth item in a list
+Val *list_func(int argc, Val **argv);       // [list (val)...] create list from arguments (variadic)
+Val *length_func(int argc, Val **argv);     // [length list]
 Val *lambda_q_func(Val *args);   // [lambda? v]
 Val *function_q_func(Val *args); // [function? v]
 Val *native_q_func(Val *args);   // [native? v]
-Val *increasing_func(Val *args); // [<= x y (expr)...] check number order
-Val *decreasing_func(Val *args); // [>= x y (expr)...] check number order
-Val *strictly_increasing_func(Val *args);   // [< x y (expr)...] check number order
-Val *strictly_decreasing_func(Val *args);   // [> x y (expr)...] check number order
+Val *increasing_func(int argc, Val **argv); // [<= x y (expr)...] check number order
+Val *decreasing_func(int argc, Val **argv); // [>= x y (expr)...] check number order
+Val *strictly_increasing_func(int argc, Val **argv);   // [< x y (expr)...] check number order
+Val *strictly_decreasing_func(int argc, Val **argv);   // [> x y (expr)...] check number order
 Val *chars_func(Val *args);      // [chars sym] -> list
 Val *symbol_func(Val *args);     // [symbol list] -> symbol
-Val *member_q_func(Val *args);   // [member? item list] -> boolean value
-Val *count_func(Val *args);      // [count item list] -> integer symbol
-Val *position_func(Val *args);   // [position item list] -> integer symbol
-Val *slice_func(Val *args);      // [slice list start (end)] gets a sublist "slice" inclusive of start and end
+Val *member_q_func(int argc, Val **argv);   // [member? item list] -> boolean value
+Val *count_func(int argc, Val **argv);      // [count item list] -> integer symbol
+Val *position_func(int argc, Val **argv);   // [position item list] -> integer symbol
+Val *slice_func(int argc, Val **argv);      // [slice list start (end)] gets a sublist "slice" inclusive of start and end
 
 // macros
 Val *quote_func(Val *args, Val *env);   // [quote expr]
@@ -180,6 +400,7 @@ Val *lambda_func(Val *args, Val *env);  // [lambda [args ...] body-expr]
 Val *and_func(Val *args, Val *env);     // [and expr1 expr2 ...]
 Val *or_func(Val *args, Val *env);      // [or expr1 expr2 ...]
 Val *let_func(Val *args, Val *env);     // [let [sym1 expr1 sym2 expr2 ...] body-expr]
+Val *set_func(Val *args, Val *env);     // [set! sym expr]
 
 #endif /* _lizp_h_ */
 
@@ -187,1935 +408,5066 @@ Val *let_func(Val *args, Val *env);     // [let [sym1 expr1 sym2 expr2 ...] body
 
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdio.h> // for snprintf
 
+// files can be mapped into memory where mmap() is, if _POSIX_C_SOURCE is
+// defined before any header is included
+#if defined(_POSIX_C_SOURCE) && (defined(__unix__) || defined(__APPLE__))
+#define LIZP_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// the reader scans with vector instructions when it can, unless
+// LIZP_NO_SIMD is defined
+#if !defined(LIZP_NO_SIMD) && defined(__SSE2__)
+#define LIZP_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIZP_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
 
-static Val *pool;
-static const char const_lambda[] = "lambda";
 static const char const_true[] = "#t";
 
 
-static char *stringCopy(const char *buf, unsigned len) {
-    if (!buf) { return NULL; }
-    char *s = malloc(len + 1);
-    if (s) {
-        memcpy(s, buf, len);
-        s[len] = 0;
-    }
-    return s;
-}
+// Slab heap.
+// Values are carved out of large chunks that are aligned to their own size,
+// so the chunk that owns a value is found by masking the value's address.
+// Each chunk counts how many of its values are in use, which lets
+// lizpHeapTrim() give completely unused chunks back.
+// Chunks are carved out of blocks that are allocated with one chunk to
+// spare for the alignment, and a block is freed once none of its chunks are
+// in use.
+#define LIZP_CHUNK_SIZE ((uintptr_t)64 * 1024)
+
+
+#define LIZP_BLOCK_CHUNKS 16
+
+
+#define LIZP_CHUNK_SLOTS (LIZP_CHUNK_SIZE / sizeof(Val))
+
+
+typedef struct LizpBlock {
+    void *raw;      // pointer from malloc(), before alignment
+    unsigned count; // number of chunks in the block
+    unsigned spare; // number of those that are not in use
+} LizpBlock;
+
+
+typedef struct LizpChunk {
+    LizpBlock *block; // block that the chunk was carved out of
+    struct LizpChunk *next; // next spare chunk, when not in use
+    unsigned live;  // number of values in use
+    bool arena;     // whether the chunk belongs to the arena
+    unsigned char tags[LIZP_CHUNK_SLOTS]; // type map: a tag for each slot
+    unsigned char refs[LIZP_CHUNK_SLOTS]; // extra references to each value
+} LizpChunk;
 
 
-// Allocate a new value
-// Potential problem: memory use currently cannot shrink
-Val *valAlloc()
+// index of the first value slot after the chunk header
+#define LIZP_CHUNK_FIRST ((sizeof(LizpChunk) + sizeof(Val) - 1) / sizeof(Val))
+
+
+// A tag holds a value's kind in the low bits and its flags in the high bits
+#define LIZP_TAG_KIND 0x0F
+#define VF_INLINE 0x10 // symbol name is stored in `name` instead of `symbol`
+#define VF_VECTOR 0x20 // native function is a LizpFuncV instead of a LizpFunc
+#define VF_ERROR 0x40 // list is an error value
+#define LIZP_TAG_MARK 0x80 // reached during garbage collection
+
+
+static struct {
+    LizpChunk **chunks; // chunk table
+    size_t count;       // number of chunks in the table
+    size_t capacity;    // allocated size of the chunk table
+    Val *free;          // free list of values, threaded through all chunks
+    LizpChunk *spare;   // chunks that are not in use, from any block
+} heap;
+
+
+static struct {
+    bool active;        // whether new values come from the arena
+    LizpChunk **chunks; // arena chunks, the last one is being filled
+    size_t count;
+    size_t capacity;
+    Val *next;          // next free value slot
+    Val *end;           // end of the chunk being filled
+    char **names;       // interned names held by arena symbols
+    size_t name_count;
+    size_t name_capacity;
+    Val **externals;    // values holding memory from outside of the arena
+    size_t external_count;
+    size_t external_capacity;
+} arena;
+
+
+// range of the preallocated integers
+#define LIZP_SMALL_INT_MIN (-128)
+#define LIZP_SMALL_INT_MAX 1023
+
+
+// Constants.
+// Values that are never freed, like the preallocated errors, live in a chunk
+// of their own. It is flagged like an arena chunk, so its values are shared
+// without counting references, valFree() leaves them alone and the collector
+// does not trace into them, but it is part of neither the heap nor the
+// arena. The chunk has room for far more than the fixed set of constants.
+static struct {
+    LizpChunk *chunk;
+    Val *free;          // free list of the chunk's value slots
+    Val *heap_free;     // heap's free list, while constants are made
+    bool arena_active;  // arena state, while constants are made
+    Val *t;             // #t
+    Val *ints[LIZP_SMALL_INT_MAX - LIZP_SMALL_INT_MIN + 1];
+} constants;
+
+
+// Preallocated errors
+static struct {
+    Val *no_memory;         // [error "out of memory"]
+    Val *division_by_zero;  // [error "division by zero"]
+} errors;
+
+
+// Garbage collector state
+static struct {
+    bool enabled;
+    size_t allocated;   // values allocated since the last collection
+    size_t threshold;   // value of `allocated` that triggers a collection
+    Val **roots;        // root stack
+    size_t root_count;  // may exceed root_capacity if the stack could not grow
+    size_t root_capacity;
+    Val **stack;        // mark stack
+    size_t stack_count;
+    size_t stack_capacity;
+    bool overflow;      // mark stack could not grow
+} gc;
+
+
+// Bytecode machine state
+static struct {
+    bool enabled;       // whether lambdas are compiled
+    Val **stack;        // value stack, frames are indexes into it
+    size_t count;
+    size_t capacity;
+} vm;
+
+
+// fewest values allocated between automatic collections
+#define LIZP_GC_MIN (4 * LIZP_CHUNK_SLOTS)
+
+
+static LizpChunk *chunkOf(const Val *p)
 {
-    if (!pool) {
-        // Create another free list of things linked together
-        const int count = 1000;
-        pool = malloc(count * sizeof(*pool));
-        for (Val *p = pool; p < pool + count - 1; p++) {
-            p->rest = p + 1;
-        }
-        pool[count - 1].rest = NULL;
-    }
+    return (LizpChunk *)((uintptr_t)p & ~(LIZP_CHUNK_SIZE - 1));
+}
 
-    Val *p = pool;
-    pool = pool->rest;
-    return p;
+
+// Get the tag of a value from its chunk's type map
+static unsigned char *valTag(const Val *p)
+{
+    LizpChunk *c = chunkOf(p);
+    return &c->tags[p - (const Val *)c];
 }
 
 
-Val *valAllocKind(ValKind k)
+// Get the count of extra references to a value, which is the number of
+// valFree() calls that only release a reference instead of the value
+static unsigned char *valRefs(const Val *p)
 {
-    Val *p = valAlloc();
-    if (p) { p->kind = k; }
-    return p;
+    LizpChunk *c = chunkOf(p);
+    return &c->refs[p - (const Val *)c];
 }
 
 
-static bool symbolIsStatic(const char *string);
+static unsigned valFlags(const Val *p) { return *valTag(p) & ~LIZP_TAG_KIND; }
 
 
-// Free value
-void valFree(Val *p)
+static void valSetFlags(Val *p, unsigned flags)
 {
-    if (!p) { return; }
-    if (valIsSymbol(p) && p->symbol && !symbolIsStatic(p->symbol)) { free(p->symbol); }
-    p->kind = VK_FREE;
-    p->rest = pool;
-    pool = p;
+    unsigned char *t = valTag(p);
+    *t = (*t & LIZP_TAG_KIND) | flags;
 }
 
 
-// Free value recursively
-void valFreeRec(Val *v)
+// Allocate a block and put its chunks on the spare list
+// Returns non-zero upon success
+static bool blockCreate(void)
 {
-    if (!v) { return; }
-    if (valIsSymbol(v))
+    LizpBlock *b = malloc(sizeof(*b));
+    void *raw = b? malloc((LIZP_BLOCK_CHUNKS + 1) * LIZP_CHUNK_SIZE) : NULL;
+    if (!raw)
     {
-        // Symbol
-        valFree(v);
-        return;
+        free(b);
+        return 0;
     }
-    if (!valIsList(v)) { return; }
-    // List
-    Val *p = v;
-    Val *n;
-    while (p && valIsList(p))
+    uintptr_t base = ((uintptr_t)raw + LIZP_CHUNK_SIZE - 1) & ~(LIZP_CHUNK_SIZE - 1);
+    b->raw = raw;
+    // the chunk to spare is usable too if malloc() happened to align it
+    b->count = LIZP_BLOCK_CHUNKS + (base == (uintptr_t)raw);
+    b->spare = b->count;
+    // link the chunks in address order
+    for (unsigned i = b->count; i-- > 0;)
     {
-        valFreeRec(p->first);
-        n = p->rest;
-        valFree(p);
-        p = n;
+        LizpChunk *c = (LizpChunk *)(base + i * LIZP_CHUNK_SIZE);
+        c->block = b;
+        c->next = heap.spare;
+        heap.spare = c;
     }
-    return;
+    return 1;
 }
 
 
-static bool symbolIsStatic(const char *string)
+// Take a spare chunk, not yet part of the heap or arena
+static LizpChunk *chunkCreate(bool is_arena)
 {
-    return string == const_lambda
-        || string == const_true;
+    if (!heap.spare && !blockCreate()) { return NULL; }
+    LizpChunk *c = heap.spare;
+    heap.spare = c->next;
+    c->block->spare--;
+    c->live = 0;
+    c->arena = is_arena;
+    memset(c->tags, VK_FREE, sizeof(c->tags));
+    memset(c->refs, 0, sizeof(c->refs));
+    return c;
 }
 
 
-bool valIsEqual(const Val *x, const Val *y)
+// Give a chunk back to its block, and free the block if none of its chunks
+// are in use anymore
+static void chunkRelease(LizpChunk *c)
 {
-    if (x == NULL || y == NULL) { return x == y; }
-    if (valIsSymbol(x))
-    {
-        // Symbol equality
-        char *a = x->symbol;
-        char *b = y->symbol;
-        while (*a && *b && *a == *b)
-        {
-            a++;
-            b++;
-        }
-        return *a == *b;
-    }
-    if (valIsList(x))
+    LizpBlock *b = c->block;
+    c->next = heap.spare;
+    heap.spare = c;
+    if (++b->spare < b->count) { return; }
+    LizpChunk **pp = &heap.spare;
+    while (*pp)
     {
-        // List equality
-        const Val *px = x, *py = y;
-        while (px && valIsList(px) && py && valIsList(py))
-        {
-            if (!valIsEqual(px->first, py->first)) { break; }
-            px = px->rest;
-            py = py->rest;
-        }
-        return px == NULL && py == NULL;
+        if ((*pp)->block == b) { *pp = (*pp)->next; }
+        else { pp = &(*pp)->next; }
     }
-    if (valIsFunc(x) && valIsFunc(y)) { return x->func == y->func; }
-    if (valIsMacro(x) && valIsMacro(y)) { return x->macro == y->macro; }
-    return 0;
+    free(b->raw);
+    free(b);
 }
 
 
-// Get a value's kind a.k.a type
-ValKind valKind(const Val *v)
+// Double the capacity of a growable array
+// Returns the new array, or NULL (and `capacity` unchanged) upon failure
+static void *arrayGrow(void *items, size_t *capacity, size_t item_size)
 {
-    if (!v) { return VK_LIST; }
-    return v->kind;
+    size_t cap = *capacity? *capacity * 2 : 16;
+    void *t = realloc(items, cap * item_size);
+    if (t) { *capacity = cap; }
+    return t;
 }
 
 
-// Check if a value is a list
-// NULL is also considered an empty list
-bool valIsList(const Val *p) { return valKind(p) == VK_LIST; }
+// Add a new chunk to the chunk table and put its values on the free list
+// Returns non-zero upon success
+static bool heapGrow(void)
+{
+    if (heap.count == heap.capacity)
+    {
+        LizpChunk **t = arrayGrow(heap.chunks, &heap.capacity, sizeof(*t));
+        if (!t) { return 0; }
+        heap.chunks = t;
+    }
+    LizpChunk *c = chunkCreate(false);
+    if (!c) { return 0; }
+    heap.chunks[heap.count++] = c;
+    // link the slots in address order so that allocation walks forward
+    Val *slots = (Val *)c;
+    for (size_t i = LIZP_CHUNK_SLOTS - 1; i >= LIZP_CHUNK_FIRST; i--)
+    {
+        slots[i].rest = heap.free;
+        heap.free = &slots[i];
+    }
+    return 1;
+}
 
 
-// Check if a value is a symbol
-bool valIsSymbol(const Val *p) { return valKind(p) == VK_SYMBOL; }
+// Start filling the next arena chunk
+// Returns non-zero upon success
+static bool arenaGrow(void)
+{
+    if (arena.count == arena.capacity)
+    {
+        LizpChunk **t = arrayGrow(arena.chunks, &arena.capacity, sizeof(*t));
+        if (!t) { return 0; }
+        arena.chunks = t;
+    }
+    LizpChunk *c = chunkCreate(true);
+    if (!c) { return 0; }
+    arena.chunks[arena.count++] = c;
+    arena.next = (Val *)c + LIZP_CHUNK_FIRST;
+    arena.end = (Val *)c + LIZP_CHUNK_SLOTS;
+    return 1;
+}
 
 
-bool valIsFunc(const Val *v) { return v && valKind(v) == VK_FUNC; }
+// Bump-allocate a value slot from the arena
+static Val *arenaAllocVal(void)
+{
+    if (arena.next == arena.end && !arenaGrow()) { return NULL; }
+    return arena.next++;
+}
 
 
-bool valIsMacro(const Val *v) { return v && valKind(v) == VK_MACRO; }
+static void atomRelease(char *name);
+static bool symbolIsStatic(const char *string);
+static void valFreeExternal(Val *p);
 
 
-//  check if a value is a integer symbol
-bool valIsInteger(const Val *v)
+// Begin allocating values from the arena
+void lizpArenaBegin(void)
 {
-    if (!valIsSymbol(v)) { return 0; }
-    const unsigned base = 10;
-    char *end;
-    strtol(v->symbol, &end, base);
-    return end && !(*end);
+    arena.active = 1;
+    if (!arena.count) { arenaGrow(); }
 }
 
 
-// Make symbol
-// NOTE: "s" MUST be a free-able string
-// NOTE: does not make a copy of the "s" string
-Val *valCreateSymbol(char *s)
+// Stop using the arena and release everything that was allocated from it.
+// The first chunk is kept for the next use of the arena.
+void lizpArenaEnd(void)
 {
-    Val *p = valAllocKind(VK_SYMBOL);
-    if (p) { p->symbol = s; }
-    return p;
+    arena.active = 0;
+    for (size_t i = 0; i < arena.name_count; i++) { atomRelease(arena.names[i]); }
+    arena.name_count = 0;
+    for (size_t i = 0; i < arena.external_count; i++) { valFreeExternal(arena.externals[i]); }
+    arena.external_count = 0;
+    if (!arena.count) { return; }
+    for (size_t i = 1; i < arena.count; i++) { chunkRelease(arena.chunks[i]); }
+    arena.count = 1;
+    LizpChunk *c = arena.chunks[0];
+    arena.next = (Val *)c + LIZP_CHUNK_FIRST;
+    arena.end = (Val *)c + LIZP_CHUNK_SLOTS;
 }
 
 
-// Make symbol
-// - copies buf to take as a name
-// - empty string -> null []
-Val *valCreateSymbolCopy(const char *buf, unsigned len)
+// Copy a value that was created in the arena to the heap.
+// Values that are not in the arena are returned as they are.
+static Val *arenaPromote(Val *v)
 {
-    return valCreateSymbol(stringCopy(buf, len));
+    if (!v || !chunkOf(v)->arena || chunkOf(v) == constants.chunk) { return v; }
+    arena.active = 0;
+    Val *copy = valCopy(v);
+    arena.active = 1;
+    return copy;
 }
 
 
-// Make symbol by copying the null-terminated `str`
-Val *valCreateSymbolStr(const char *str)
+// Begin allocating values from the constants chunk, by putting its free
+// list in place of the heap's
+// Returns non-zero upon success
+static bool constBegin(void)
 {
-    return valCreateSymbolCopy(str, strlen(str));
+    if (!constants.chunk)
+    {
+        LizpChunk *c = chunkCreate(true);
+        if (!c) { return 0; }
+        constants.chunk = c;
+        Val *slots = (Val *)c;
+        for (size_t i = LIZP_CHUNK_SLOTS - 1; i >= LIZP_CHUNK_FIRST; i--)
+        {
+            slots[i].rest = constants.free;
+            constants.free = &slots[i];
+        }
+    }
+    constants.heap_free = heap.free;
+    constants.arena_active = arena.active;
+    heap.free = constants.free;
+    arena.active = 0;
+    return 1;
 }
 
 
-// Make a symbol for an integer
-Val *valCreateInteger(long n)
+// Go back to allocating values from the heap
+static void constEnd(void)
 {
-    const char *fmt = "%ld";
-    const unsigned sz = snprintf(NULL, 0, fmt, n);
-    char buf[sz + 1];
-    snprintf(buf, sizeof(buf), fmt, n);
-    return valCreateSymbolCopy(buf, sz);
+    constants.free = heap.free;
+    heap.free = constants.heap_free;
+    arena.active = constants.arena_active;
 }
 
 
-// Make a proper list.
-// - first: sym or list (null included)
-// - rest: list (NULL included)
-// NOTE: rest must be NULL or a list Val.
-Val *valCreateList(Val *first, Val *rest) {
-    if (!valIsList(rest)) { return NULL; } // allow proper lists only
-    Val *p = valAllocKind(VK_LIST);
-    if (p)
-    {
-        p->first = first;
-        p->rest = rest;
-    }
-    return p;
-}
+// Interned symbol names.
+// Each distinct name is stored once, as an atom in an open-addressing hash
+// set. Atoms count the symbols that use them and are freed with the last one.
+typedef struct LizpAtom {
+    unsigned refs;  // number of symbols using this name
+    unsigned hash;
+    size_t len;
+    char name[];    // null-terminated
+} LizpAtom;
+
 
+static struct {
+    LizpAtom **slots;   // hash set with linear probing, NULL for empty
+    size_t capacity;    // power of two
+    size_t count;
+} atoms;
 
-static Val *valCreateFunc(LizpFunc *f) 
+
+static LizpAtom *atomOf(const char *name)
 {
-    Val *p = valAllocKind(VK_FUNC);
-    if (p) { p->func = f; }
-    return p;
+    return (LizpAtom *)(name - offsetof(LizpAtom, name));
 }
 
 
-static Val *valCreateMacro(LizpMacro *m) 
+// FNV-1a hash
+static unsigned hashBytes(const char *buf, size_t len)
 {
-    Val *p = valAllocKind(VK_MACRO);
-    if (p) { p->macro = m; }
-    return p;
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)buf[i];
+        h *= 16777619u;
+    }
+    return h;
 }
 
 
-// New copy, with no structure-sharing
-Val *valCopy(const Val *p)
+// Double the size of the atom table
+// Returns non-zero upon success
+static bool atomsGrow(void)
 {
-    if (!p) { return NULL; }
-    if (valIsSymbol(p)) { return valCreateSymbolStr(p->symbol); }
-    if (valIsFunc(p)) { return valCreateFunc(p->func); }
-    if (valIsMacro(p)) { return valCreateMacro(p->macro); }
-    if (!valIsList(p)) { return NULL; }
-    // Copy list
-    Val *copy = valCreateList(valCopy(p->first), NULL);
-    Val *pcopy = copy;
-    p = p->rest;
-    while (valIsList(p) && p)
+    size_t cap = atoms.capacity? atoms.capacity * 2 : 256;
+    LizpAtom **t = calloc(cap, sizeof(*t));
+    if (!t) { return 0; }
+    for (size_t i = 0; i < atoms.capacity; i++)
     {
-        pcopy->rest = valCreateList(valCopy(p->first), NULL);
-        pcopy = pcopy->rest;
-        p = p->rest;
+        LizpAtom *a = atoms.slots[i];
+        if (!a) { continue; }
+        size_t j = a->hash & (cap - 1);
+        while (t[j]) { j = (j + 1) & (cap - 1); }
+        t[j] = a;
     }
-    return copy;
+    free(atoms.slots);
+    atoms.slots = t;
+    atoms.capacity = cap;
+    return 1;
 }
 
 
-// String needs quotes?
-// Check if a string for a symbol name needs to be quoted
-// in order to be printed "readably".
-bool StrNeedsQuotes(const char *s)
+// Get the interned copy of a name, adding it if it is new.
+// The caller owns one reference to the returned name.
+static char *atomIntern(const char *buf, size_t len)
 {
-    while (*s)
+    if (!buf) { return NULL; }
+    if (2 * (atoms.count + 1) > atoms.capacity && !atomsGrow()) { return NULL; }
+    unsigned h = hashBytes(buf, len);
+    size_t mask = atoms.capacity - 1;
+    size_t i = h & mask;
+    for (LizpAtom *a; (a = atoms.slots[i]); i = (i + 1) & mask)
     {
-        switch (*s)
+        if (a->hash == h && a->len == len && !memcmp(a->name, buf, len))
         {
-            case '[':
-            case ']':
-            case '(':
-            case ')':
-            case '\n':
-            case '\t':
-            case '"':
-            case '\\':
-                return 1;
-            default:
-                if (isspace(*s))
-                {
-                    return 1;
-                }
+            a->refs++;
+            return a->name;
         }
-        s++;
     }
-    return 0;
+    LizpAtom *a = malloc(sizeof(*a) + len + 1);
+    if (!a) { return NULL; }
+    a->refs = 1;
+    a->hash = h;
+    a->len = len;
+    memcpy(a->name, buf, len);
+    a->name[len] = 0;
+    atoms.slots[i] = a;
+    atoms.count++;
+    return a->name;
 }
 
-// Escape a string.
-//   (or is this called "un-escaping"?)
-// Converts escape sequences into the corresponding real ASCII
-// values.
-// Modifies the string in-place
-unsigned EscapeStr(char *str, unsigned len)
+
+// Drop a reference to an interned name, and remove it when it is unused
+static void atomRelease(char *name)
 {
-    if (!str || len <= 0) { return 0; }
-    unsigned r = 0; // read index
-    unsigned w = 0; // write index
-    while (r < len && str[r])
+    LizpAtom *a = atomOf(name);
+    if (--a->refs) { return; }
+    size_t mask = atoms.capacity - 1;
+    size_t i = a->hash & mask;
+    while (atoms.slots[i] != a) { i = (i + 1) & mask; }
+    // shift later entries of the probe sequence back into the hole
+    size_t j = i;
+    while (1)
     {
-        char c = str[r];
-        if (c == '\\')
+        j = (j + 1) & mask;
+        LizpAtom *b = atoms.slots[j];
+        if (!b) { break; }
+        size_t k = b->hash & mask;
+        bool movable = (i <= j)? (k <= i || k > j) : (k <= i && k > j);
+        if (movable)
         {
-            r++;
-            c = str[r];
-            switch (c)
-            {
-                case 'a':
-                    c = '\a';
-                    break;
-                case 'b':
-                    c = '\b';
-                    break;
-                case 'e': // escape
-                    c = '\x1b';
-                    break;
-                case 'n':
-                    c = '\n';
-                    break;
-                case 'r':
-                    c = '\r';
-                    break;
-                case 't':
-                    c = '\t';
-                    break;
-                default:
-                    // default result character is itself 
-                    break;
-            }
+            atoms.slots[i] = b;
+            i = j;
         }
-        str[w] = c;
-        r++;
-        w++;
     }
-    str[w] = '\0';
-    return w;
+    atoms.slots[i] = NULL;
+    atoms.count--;
+    free(a);
 }
 
-// Skip space and nested comments within `str`
-// Returns the next index into `str`
-unsigned SkipChars(const char *str, unsigned len)
+
+// Hash table scopes.
+// A scope of an environment starts out as an association list of [key val]
+// pairs. Once it has more than LIZP_SCOPE_LINEAR bindings, it is replaced by
+// a VK_SCOPE value that points to an open-addressing hash table of binding
+// cells. Cells are allocated one by one, so they never move.
+#define LIZP_SCOPE_LINEAR 8
+
+
+typedef struct LizpBinding {
+    Val *key;
+    Val *val;
+    unsigned hash;
+} LizpBinding;
+
+
+typedef struct LizpScope {
+    LizpBinding **slots;    // hash table with linear probing, NULL for empty
+    size_t capacity;        // power of two
+    size_t count;
+} LizpScope;
+
+
+// Compiled lambda body
+typedef struct LizpCode {
+    int *ops;           // instructions and their operands
+    size_t count;
+    size_t capacity;
+    Val **consts;       // constant pool
+    size_t const_count;
+    size_t const_capacity;
+    unsigned params;    // number of parameters
+    bool rest;          // whether the last parameter gets the rest of the arguments
+    unsigned locals;    // number of frame slots for parameters and `let` variables
+    bool self;          // whether the slot after the parameters holds the lambda
+    Val *source;        // body that was compiled
+} LizpCode;
+
+
+// Free a scope's table, but not the values in it
+static void scopeFree(LizpScope *t)
 {
-    unsigned i = 0;
-    unsigned level = 0; // nesting level
-    while (i < len)
+    for (size_t i = 0; i < t->capacity; i++) { free(t->slots[i]); }
+    free(t->slots);
+    free(t);
+}
+
+
+// Free a compiled body, but not the values in it
+static void codeFree(LizpCode *code)
+{
+    free(code->ops);
+    free(code->consts);
+    free(code);
+}
+
+
+// Lambda
+typedef struct LizpClosure {
+    Val *params;        // parameter symbols
+    Val *body;          // resolved or compiled body
+    Val *self;          // name that the lambda sees itself as, or NULL
+    unsigned arity;     // number of parameters, or UINT_MAX if it takes no arguments
+    bool rest;          // whether the last parameter gets the rest of the arguments
+} LizpClosure;
+
+
+// Free the memory a value holds outside of the heap, but not the values in it
+static void valFreeExternal(Val *p)
+{
+    switch (valKind(p))
     {
-        char c = str[i];
-        if (!c) { break; }
-        if (c == '(')
-        {
-            i++;
-            level++;
-            continue;
-        }
-        if (level && c == ')')
-        {
-            i++;
-            level--;
-            continue;
-        }
-        if (!level && !isspace(c)) { break; }
-        i++;
+        case VK_SCOPE:
+            scopeFree(p->scope);
+            break;
+        case VK_CODE:
+            codeFree(p->code);
+            break;
+        case VK_CLOSURE:
+            free(p->closure);
+            break;
+        default:
+            break;
     }
-    return i;
 }
 
-// Read a value from the input buffer.
-// Return value: the number of CHARACTERS read.
-// see also: valReadAllFromBuffer()
-unsigned valReadOneFromBuffer(const char *str, unsigned len, Val **out)
+
+// Allocate a value that holds memory from outside of the heap, which the
+// arena frees when it is reset
+static Val *valAllocExternal(ValKind kind)
 {
-    if (!out || !str || len <= 0) { return 0; }
-    unsigned i = 0;
-    i += SkipChars(str + i, len - i);
-    switch (str[i])
+    if (arena.active && arena.external_count == arena.external_capacity)
     {
-    case '\0': // end of string
-        *out = valCreateErrorMessage("reached an unexpected end of input");
-        return i;
-    case ']':  // unmatched list
-        *out = valCreateErrorMessage("read an unexpected '['");
-        return i;
-    case '(':  // uncaught comment
-        *out = valCreateErrorMessage("read an unexpected '('");
-        return i;
-    case ')':  // uncaught comment
-        *out = valCreateErrorMessage("read an unexpected ')'");
-        return i;
-    case '[':
-        // begin list
-        {
-            i++;
-            // empty list?
-            i += SkipChars(str + i, len - i);
-            if (str[i] == ']')
-            {
-                i++;
-                *out = NULL;
-                return i;
-            }
-            // first item
-            Val *e;
-            unsigned l = valReadOneFromBuffer(str + i, len - i, &e);
-            if (!l)
-            {
-                *out = NULL;
-                return i;
-            };
-            i += l;
-            Val *list = valCreateList(e, NULL);
-            Val *p = list;
-            // rest of items
-            while (i < len && str[i] != ']')
-            {
-                Val *e;
-                unsigned l = valReadOneFromBuffer(str + i, len - i, &e);
-                i += l;
-                p->rest = valCreateList(e, NULL);
-                p = p->rest;
-                if (l <= 0)
-                {
-                    *out = list;
-                    return l;
-                }
-                i += SkipChars(str + i, len - i);
-            }
-            *out = list;
-            if (str[i] == ']')
-            {
-                i++;
-                i += SkipChars(str + i, len - i);
-            }
-            return i;
-        }
-    default:
-        // Symbol
-        {
-            // leading space
-            i += SkipChars(str + i, len);
-            switch (str[i])
-            {
-                case '\0':
-                    // No symbol
-                    if (out) { *out = NULL; }
-                    return i;
-                case '"':
-                    // Quoted symbol
-                    {
-                        i++;
-                        const unsigned j = i;
-                        bool done = 0, good = 0;
-                        while (!done && i < len)
-                        {
-                            switch (str[i])
-                            {
-                                case '\n':
-                                case '\0':
-                                    done = 1;
-                                    break;
-                                case '\\':
-                                    i++;
-                                    if (str[i] == '"') { i++; }
-                                    break;
-                                case '"':
-                                    done = 1;
-                                    good = 1;
-                                    i++;
-                                    break;
-                                default:
-                                    i++;
-                                    break;
-                            }
-                        }
-                        if (good && out)
-                        {
-                            // Make escaped symbol string
-                            unsigned len = i - j - 1;
-                            if (len == 0)
-                            {
-                                *out = NULL;
-                                return i;
-                            }
-                            char *str1 = malloc(len + 1);
-                            memcpy(str1, str + j, len);
-                            str1[len] = 0;
-                            unsigned len2 = EscapeStr(str1, len);
-                            *out = valCreateSymbolCopy(str1, len2);
-                            free(str1);
-                            return i;
-                        }
-                        if (out) { *out = NULL; } // invalid
-                        return i;
-                    }
-                default:
-                    // Symbol (not in quotes)
-                    {
-                        const unsigned j = i;
-                        bool done = 0;
-                        while (!done && i < len)
-                        {
-                            switch (str[i])
-                            {
-                                case '\0':
-                                case '"':
-                                case '[':
-                                case ']':
-                                case '(':
-                                case ')':
-                                    done = 1;
-                                    break;
-                                default:
-                                    if (isspace(str[i]))
-                                    {
-                                        done = 1;
-                                        break;
-                                    }
-                                    i++;
-                                    break;
-                            }
-                        }
-                        if (out)
-                        {
-                            *out = valCreateSymbolCopy(str + j, i - j);
-                        }
-                        return i;
-                    }
-            }
-        }
+        Val **t = arrayGrow(arena.externals, &arena.external_capacity, sizeof(*t));
+        if (!t) { return NULL; }
+        arena.externals = t;
     }
+    Val *v = valAllocKind(kind);
+    if (v && arena.active) { arena.externals[arena.external_count++] = v; }
+    return v;
 }
 
-// Read all values from buffer.
-// Return value: the number of VALUES read.
-// see also: valReadOneFromBuffer()
-unsigned valReadAllFromBuffer(const char *str, unsigned len, Val **out)
-{
-    unsigned i = 0;
-    Val *val = NULL;
 
-    // Read first item... (may be the only item)
-    unsigned read_len = valReadOneFromBuffer(str + i, len - i, &val);
-    if (!read_len) { return 0; }
-    i += read_len;
-    i += SkipChars(str + i, len - i);
-    if (valIsError(val) || i >= len || !str[i])
+// Make a VK_CODE value, or free the code upon failure
+static Val *codeCreate(LizpCode *code)
+{
+    Val *v = valAllocExternal(VK_CODE);
+    if (!v)
     {
-        *out = val;
-        return 1;
+        for (size_t i = 0; i < code->const_count; i++) { valFreeRec(code->consts[i]); }
+        valFreeRec(code->source);
+        codeFree(code);
+        return NULL;
     }
+    v->code = code;
+    return v;
+}
+
 
-    // Read additional items into a list...
-    unsigned n; // number of items read
-    val = valCreateList(val, NULL);
-    Val *p = val;
-    for (n = 1; i < len && str[i]; n++, p = p->rest)
+// Deep copy a VK_CODE value
+static Val *codeCopy(const Val *v)
+{
+    const LizpCode *code = v->code;
+    LizpCode *copy = malloc(sizeof(*copy));
+    if (!copy) { return NULL; }
+    *copy = *code;
+    copy->ops = malloc(code->count * sizeof(*copy->ops));
+    copy->consts = malloc(code->const_count * sizeof(*copy->consts) + 1);
+    if (!copy->ops || !copy->consts)
     {
-        Val *e = NULL;
-        read_len = valReadOneFromBuffer(str + i, len - i, &e);
-        if (valIsError(e))
-        {
-            valFreeRec(val);
-            val = e;
-            break;
-        }
-        if (!read_len) { break; }
-        i += read_len;
-        i += SkipChars(str + i, len - i);
-        p->rest = valCreateList(e, NULL);
+        codeFree(copy);
+        return NULL;
     }
-
-    *out = val;
-    return n;
+    memcpy(copy->ops, code->ops, code->count * sizeof(*copy->ops));
+    copy->capacity = code->count;
+    for (size_t i = 0; i < code->const_count; i++) { copy->consts[i] = valCopy(code->consts[i]); }
+    copy->const_capacity = code->const_count;
+    copy->source = valCopy(code->source);
+    return codeCreate(copy);
 }
 
-// Prints p to the given `out` buffer.
-// Does not do null termination.
-// If out is NULL, it just calculates the print length
-// Returns: number of chars written
-unsigned valWriteToBuffer(const Val *v, char *out, unsigned length, bool readable)
+
+// Make a lambda that takes ownership of params, body and self
+static Val *closureCreate(Val *params, Val *body, Val *self)
 {
-    // String output count / index
-    unsigned i = 0;
-    if (valIsList(v))
+    LizpClosure *f = malloc(sizeof(*f));
+    Val *v = f? valAllocExternal(VK_CLOSURE) : NULL;
+    if (!v)
     {
-        if (out && i < length) { out[i] = '['; }
-        i++;
-        if (v)
-        {
-            // first item
-            if (out)
-            {
-                i += valWriteToBuffer(v->first, out + i, length - i, readable);
-            }
-            else
-            {
-                i += valWriteToBuffer(v->first, NULL, 0, readable);
-            }
-            v = v->rest;
-            while (v)
-            {
-                // space
-                if (out && i < length) { out[i] = ' '; }
-                i++;
-                // item
-                if (out)
-                {
-                    i += valWriteToBuffer(v->first, out + i, length - i, readable);
-                }
-                else
-                {
-                    i += valWriteToBuffer(v->first, NULL, 0, readable);
-                }
-                v = v->rest;
-            }
-        }
-        if (out && i < length) { out[i] = ']'; }
-        i++;
-        return i;
+        free(f);
+        valFreeRec(params);
+        valFreeRec(body);
+        valFreeRec(self);
+        return NULL;
     }
-    else if (valIsSymbol(v))
+    f->params = params;
+    f->body = body;
+    f->self = self;
+    f->arity = 0;
+    f->rest = 0;
+    bool misplaced = 0;
+    for (Val *p = params; p; p = p->rest)
     {
-        // Symbol
-        char *s = v->symbol;
-        bool quoted = readable && StrNeedsQuotes(s);
-        if (quoted)
-        {
-            // Opening quote
-            if (out && i < length)
-            {
-                out[i] = '"';
-            }
-            i++;
-        }
-        // Contents
-        while (*s)
-        {
-            char c = *s;
-            if (quoted)
-            {
-                // escaping
-                bool esc = false;
-                switch (c)
-                {
-                    case '\r':
-                        c = 'r';
-                        esc = true;
-                        break;
-                    case '\n':
-                        c = 'n';
-                        esc = true;
-                        break;
-                    case '\t':
-                        c = 't';
-                        esc = true;
-                        break;
-                    case '"':
-                        c = '"';
-                        esc = true;
-                        break;
-                    case '\\':
-                        c = '\\';
-                        esc = true;
-                        break;
-                }
-                if (esc)
-                {
-                    if (out && i < length)
-                    {
-                        out[i] = '\\';
-                    }
-                    i++;
-                }
-            }
-            if (out && i < length)
-            {
-                out[i] = c;
-            }
-            i++;
-            s++;
-        }
-        if (quoted)
-        {
-            // Closing quote
-            if (out && i < length)
-            {
-                out[i] = '"';
-            }
-            i++;
-        }
-        return i;
-    }
-    else if (valIsFunc(v)) {
-        const char txt[] = "<native func>";
-        const size_t len = sizeof(txt) - 1;
-        if (out) { memcpy(out, txt, len); }
-        return len;
-    }
-    else if (valIsMacro(v)) {
-        const char txt[] = "<native macro>";
-        const size_t len = sizeof(txt) - 1;
-        if (out) { memcpy(out, txt, len); }
-        return len;
+        // parameter beginning with '&' binds the rest of the arguments
+        char buf[LIZP_INT_CHARS];
+        f->arity++;
+        f->rest = '&' == valSymbolName(p->first, buf)[0];
+        misplaced |= f->rest && p->rest;
     }
-    else {
-        return 0;
+    if (misplaced)
+    {
+        // a rest parameter that is not the last one matches no arguments
+        f->arity = UINT_MAX;
+        f->rest = 0;
     }
+    v->closure = f;
+    return v;
 }
 
-// Print value to a new string
-char *valWriteToNewString(const Val *v, bool readable)
+
+// Check whether a value is a resolved variable reference
+static bool valIsRef(const Val *v)
 {
-    unsigned len1 = valWriteToBuffer(v, NULL, 0, readable);
-    if (len1 <= 0) { return NULL; }
-    char *s = malloc(len1 + 1);
-    if (!s) { return NULL; }
-    unsigned len2 = valWriteToBuffer(v, s, len1, readable);
-    if (len1 != len2) { return NULL; } // should not happen unless there is a bug in valWriteToBuffer()
-    s[len2] = '\0';
-    return s;
+    ValKind k = valKind(v);
+    return k == VK_LOCAL || k == VK_CAPTURED || k == VK_GLOBAL;
 }
 
 
-bool valListLengthIsMoreThan(const Val *l, unsigned len)
+// Hash a value consistently with valIsEqual()
+static unsigned valHash(const Val *v)
 {
-    while (l && len)
+    switch (valKind(v))
     {
-        len--;
-        l = l->rest;
+        case VK_INT:
+            return hashBytes((const char *)&v->integer, sizeof(v->integer));
+        case VK_SYMBOL:
+            // long names are interned, so the pointer identifies the name
+            if (valFlags(v) & VF_INLINE) { return hashBytes(v->name, sizeof(v->name)); }
+            return hashBytes((const char *)&v->symbol, sizeof(v->symbol));
+        case VK_LOCAL:
+        case VK_CAPTURED:
+        case VK_GLOBAL:
+            return valHash(v->var);
+        case VK_CODE:
+            return valHash(v->code->source);
+        case VK_CLOSURE:
+            return valHash(v->closure->params) * 31 + valHash(v->closure->body);
+        case VK_LIST:
+            {
+                unsigned h = 1;
+                for (; v && valIsList(v); v = v->rest) { h = h * 31 + valHash(v->first); }
+                return h;
+            }
+        default:
+            return hashBytes((const char *)&v, sizeof(v));
     }
-    return !len && l;
 }
 
 
-bool valListLengthIsLessThan(const Val *l, unsigned len)
+// Find the slot for a key, which is either empty or holds the key's binding
+static LizpBinding **scopeFind(LizpScope *t, const Val *key, unsigned h)
 {
-    while (l && len)
+    size_t mask = t->capacity - 1;
+    size_t i = h & mask;
+    for (LizpBinding *b; (b = t->slots[i]); i = (i + 1) & mask)
     {
-        len--;
-        l = l->rest;
+        if (b->hash == h && valIsEqual(b->key, key)) { break; }
     }
-    return len && !l;
+    return &t->slots[i];
 }
 
 
-// inclusive range
-bool valListLengthIsWithin(const Val *l, unsigned min, unsigned max)
+// Get the binding of a key, or NULL if there is none
+static LizpBinding *scopeGet(LizpScope *t, const Val *key)
 {
-    return !valListLengthIsLessThan(l, min) && !valListLengthIsMoreThan(l, max);
+    return *scopeFind(t, key, valHash(key));
 }
 
 
-// Get the length of a list.
-// Returns 0 for a non-list value.
-unsigned valListLength(const Val *l)
+// Double the size of a scope's table
+// Returns non-zero upon success
+static bool scopeGrow(LizpScope *t)
 {
-    unsigned len = 0;
-    while (l && valIsList(l))
+    size_t cap = t->capacity? t->capacity * 2 : 4 * LIZP_SCOPE_LINEAR;
+    LizpBinding **slots = calloc(cap, sizeof(*slots));
+    if (!slots) { return 0; }
+    for (size_t i = 0; i < t->capacity; i++)
     {
-        len++;
-        l = l->rest;
+        LizpBinding *b = t->slots[i];
+        if (!b) { continue; }
+        size_t j = b->hash & (cap - 1);
+        while (slots[j]) { j = (j + 1) & (cap - 1); }
+        slots[j] = b;
     }
-    return len;
+    free(t->slots);
+    t->slots = slots;
+    t->capacity = cap;
+    return 1;
 }
 
 
-long valAsInteger(const Val *v)
+// Bind a key in a scope, replacing an existing binding of the key.
+// Takes ownership of the key and value upon success.
+// Returns non-zero upon success
+static bool scopeSet(LizpScope *t, Val *key, Val *val)
 {
-    if (!valIsInteger(v)) { return 0; }
-    return atol(v->symbol);
+    if (2 * (t->count + 1) > t->capacity && !scopeGrow(t)) { return 0; }
+    unsigned h = valHash(key);
+    LizpBinding **slot = scopeFind(t, key, h);
+    LizpBinding *b = *slot;
+    if (b)
+    {
+        valFreeRec(b->val);
+        valFreeRec(key);
+        b->val = val;
+        return 1;
+    }
+    b = malloc(sizeof(*b));
+    if (!b) { return 0; }
+    b->key = key;
+    b->val = val;
+    b->hash = h;
+    *slot = b;
+    t->count++;
+    return 1;
 }
 
 
-// Get value right after a symbol in a list
-bool valGetListItemAfterSymbol(Val *list, const char *symname, Val **out)
+// Free the keys and values bound in a scope
+static void scopeFreeBindings(LizpScope *t)
 {
-    if (!valIsList(list)) { return 0; }
-    while (list)
+    for (size_t i = 0; i < t->capacity; i++)
     {
-        Val *e = list->first;
-        if (valIsSymbol(e) && !strcmp(e->symbol, symname))
-        {
-            // found a spot
-            list = list->rest;
-            if (!list) { return 0; }
-            *out = list->first;
-            return 1;
-        }
-        list = list->rest;
+        LizpBinding *b = t->slots[i];
+        if (!b) { continue; }
+        valFreeRec(b->key);
+        valFreeRec(b->val);
     }
-    return 0;
 }
 
 
-Val *valGetListIndex(Val *list, size_t index)
+// Allocate a new value
+Val *valAlloc()
 {
-    while (list && index) { list = list->rest; }
-    return list;
+    if (arena.active) { return arenaAllocVal(); }
+    if (!heap.free && !heapGrow()) { return NULL; }
+    Val *p = heap.free;
+    heap.free = p->rest;
+    chunkOf(p)->live++;
+    gc.allocated++;
+    return p;
 }
 
 
-// Get the Nth item in a list (0-based index)
-Val *NthItem(Val *list, unsigned n)
+// Release the chunks that have no values in use.
+// Return value: the number of chunks released
+size_t lizpHeapTrim(void)
 {
-    if (!valIsList(list)) { return NULL; }
-    for (; n > 0; n--)
+    size_t empty = 0;
+    for (size_t i = 0; i < heap.count; i++)
     {
-        list = list->rest;
+        if (!heap.chunks[i]->live) { empty++; }
     }
-    return list? list->first : list;
+    if (!empty) { return 0; }
+    // unlink the free values that belong to empty chunks
+    Val **pp = &heap.free;
+    while (*pp)
+    {
+        if (chunkOf(*pp)->live) { pp = &(*pp)->rest; }
+        else { *pp = (*pp)->rest; }
+    }
+    // free the empty chunks and compact the chunk table
+    size_t n = 0;
+    for (size_t i = 0; i < heap.count; i++)
+    {
+        LizpChunk *c = heap.chunks[i];
+        if (c->live) { heap.chunks[n++] = c; }
+        else { chunkRelease(c); }
+    }
+    heap.count = n;
+    return empty;
 }
 
-// Check if two values do not share structure
-bool IsSeparate(Val *a, Val *b)
+
+// Put a heap value slot back on the free list
+static void slotFree(Val *p)
 {
-    // empty list (NULL) is separate from anything
-    if (!a || !b) { return 1; }
-    // the same object is not separate from itself
-    if (a == b) { return 0; }
-    // symbols are separate if they have different symbol strings
-    if (valIsSymbol(a) && valIsSymbol(b)) { return a->symbol != b->symbol; }
-    // lists are separate if everything under them are separate
-    if (valIsList(a) && valIsList(b))
-    {
-        return IsSeparate(a->first, b->first)
-            && IsSeparate(a->first, b->rest)
-            && IsSeparate(a->rest, b->first)
-            && IsSeparate(a->rest, b->rest);
-    }
-    // symbol and list are separate if the list
-    // (and sublists) never contains the symbol
-    if (valIsSymbol(a))
-    {
-        // swap to make sure `a` is list and `b` is symbol
-        Val *t = b;
-        b = a;
-        a = t;
-    }
-    return IsSeparate(a->first, b)
-        && IsSeparate(a->rest, b);
+    unsigned char *tag = valTag(p);
+    assert(*tag != VK_FREE && "value freed twice");
+    if (*tag == VK_SYMBOL && p->symbol && !symbolIsStatic(p->symbol)) { atomRelease(p->symbol); }
+    valFreeExternal(p);
+    *tag = VK_FREE;
+    p->rest = heap.free;
+    heap.free = p;
+    chunkOf(p)->live--;
 }
 
 
-// Check whether a value is considered as true
-bool valIsTrue(const Val *v) { return v != NULL; }
-
-
-Val *valCreateTrue(void) { return valCreateSymbolStr(const_true); }
-
-
-Val *valCreateFalse(void) { return NULL; }
-
-
-// make a list of the form [error rest...]
-Val *valCreateError(Val *rest)
+// Switch to garbage collection mode. There is no way back, because values
+// start sharing structure.
+void lizpGcEnable(void)
 {
-    Val *e = valCreateSymbolStr("error");
-    if (valIsList(rest)) { return valCreateList(e, rest); }
-    return valCreateList(e, valCreateList(rest, NULL));
+    gc.enabled = 1;
+    gc.allocated = 0;
+    gc.threshold = LIZP_GC_MIN;
 }
 
 
-Val *valCreateErrorMessage(const char *msg)
-{
-    return valCreateError(valCreateSymbolStr(msg));
-}
-
-// Check whether a value is a lambda value (special list)
-bool valIsLambda(const Val *v)
+// Add a value to the root stack, so it survives garbage collections
+void lizpRootPush(Val *v)
 {
-    if (!v || !valIsList(v)) { return 0; }
-    Val *l = v->first;
-    if (!l || !valIsSymbol(l)) { return 0; }
-    if (l->symbol != const_lambda) { return 0; } // must be the exact "private" pointer
-    if (!v->rest) { return 0; }
-    Val *params = v->rest->first;
-    if (!valIsList(params)) { return 0; }
-    Val *pp = params;
-    while (pp && valIsList(pp))
+    if (gc.root_count >= gc.root_capacity)
     {
-        if (!valIsSymbol(pp->first)) { return 0; }
-        pp = pp->rest;
+        Val **t = arrayGrow(gc.roots, &gc.root_capacity, sizeof(*t));
+        if (t) { gc.roots = t; }
     }
-    if (!v->rest->rest) { return 0; }
-    return 1;
-}
-
-
-// check if the value matches the form [error ...]
-bool valIsError(const Val *v)
-{
-    if (!v || !valIsList(v)) { return 0; }
-    Val *first = v->first;
-    return valIsSymbol(first) && !strcmp("error", first->symbol);
+    // a root that did not fit still counts, and blocks collections
+    if (gc.root_count < gc.root_capacity) { gc.roots[gc.root_count] = v; }
+    gc.root_count++;
 }
 
 
-// Set value in environment
-// Key and Val Arguments should by copies of Values
-// Returns non-zero upon success
-bool EnvSet(Val *env, Val *key, Val *val)
+// Remove the last `n` values from the root stack
+void lizpRootPop(size_t n)
 {
-    if (!env || !valIsList(env)) { return 0; }
-    Val *pair = valCreateList(key, valCreateList(val, NULL));
-    if (!pair) { return 0; }
-    // push key-value pair onto the front of the list
-    env->first = valCreateList(pair, env->first);
-    return 1;
+    assert(n <= gc.root_count);
+    gc.root_count -= n;
 }
 
 
-// Set value in environment
-// Arguments should by copies of Values
-// Returns non-zero upon success
-bool EnvSet_const(Val *env, const Val *key, const Val *val)
+static void gcMarkPush(Val *v)
 {
-    Val *key_copy = valCopy(key);
-    Val *val_copy = valCopy(val);
-    return EnvSet(env, key_copy, val_copy);
+    if (gc.stack_count == gc.stack_capacity)
+    {
+        Val **t = arrayGrow(gc.stack, &gc.stack_capacity, sizeof(*t));
+        if (!t)
+        {
+            gc.overflow = 1;
+            return;
+        }
+        gc.stack = t;
+    }
+    gc.stack[gc.stack_count++] = v;
 }
 
 
-// Environment Get.
-// Get value in environment, does not return a copy
-// Return value: whether the symbol is present
-bool EnvGet(Val *env, const Val *key, Val **out)
+// Mark everything reachable from a value
+static void gcMark(Val *v)
 {
-    if (!env) { return 0; }
-    Val *scope = env;
-    while (scope && valIsList(scope))
+    gcMarkPush(v);
+    while (gc.stack_count)
     {
-        Val *p = scope->first;
-        while (p && valIsList(p))
+        // follow `rest` in a loop and `first` through the mark stack
+        for (Val *p = gc.stack[--gc.stack_count]; p; p = p->rest)
         {
-            Val *pair = p->first;
-            if (pair && valIsList(pair) && valIsEqual(pair->first, key))
+            if (chunkOf(p)->arena) { break; }
+            unsigned char *tag = valTag(p);
+            if (*tag & LIZP_TAG_MARK) { break; }
+            *tag |= LIZP_TAG_MARK;
+            if ((*tag & LIZP_TAG_KIND) == VK_SCOPE)
             {
-                if (out) { *out = pair->rest->first; }
-                return 1;
+                LizpScope *t = p->scope;
+                for (size_t i = 0; i < t->capacity; i++)
+                {
+                    if (!t->slots[i]) { continue; }
+                    gcMarkPush(t->slots[i]->key);
+                    gcMarkPush(t->slots[i]->val);
+                }
+                break;
             }
-            p = p->rest;
+            if ((*tag & LIZP_TAG_KIND) == VK_CODE)
+            {
+                LizpCode *code = p->code;
+                for (size_t i = 0; i < code->const_count; i++) { gcMarkPush(code->consts[i]); }
+                gcMarkPush(code->source);
+                break;
+            }
+            if ((*tag & LIZP_TAG_KIND) == VK_CLOSURE)
+            {
+                gcMarkPush(p->closure->params);
+                gcMarkPush(p->closure->body);
+                gcMarkPush(p->closure->self);
+                break;
+            }
+            if ((*tag & LIZP_TAG_KIND) == VK_CAPTURED) { gcMarkPush(p->value); }
+            if (valIsRef(p))
+            {
+                gcMarkPush(p->var);
+                break;
+            }
+            if ((*tag & LIZP_TAG_KIND) != VK_LIST) { break; }
+            if (p->first) { gcMarkPush(p->first); }
         }
-        // outer scope
-        scope = scope->rest;
     }
-    return 0;
-}
-
-
-// push a new context onto the environment
-void EnvPush(Val *env)
-{
-    if (!env) { return; }
-    env->rest = valCreateList(env->first, env->rest);
-    env->first = NULL;
-}
-
-
-// pop off the latest context from the environment
-void EnvPop(Val *env)
-{
-    if (!env) { return; }
-    valFreeRec(env->first);
-    Val *pair = env->rest;
-    env->first = pair->first;
-    env->rest = pair->rest;
-    // Only free the one pair
-    valFree(pair);
 }
 
 
-// Return values must not share structure with first, args, or env
-static Val *ApplyLambda(Val *first, Val *args, Val *env)
+// Free all heap values that are not reachable from the root stack.
+// Does nothing while the arena is active.
+// Return value: the number of values freed
+size_t lizpGcCollect(void)
 {
-    Val *params = first->rest->first;
-    Val *body = first->rest->rest->first;
-    // push env
-    EnvPush(env);
-    // bind values
-    Val *p_params = params;
-    Val *p_args = args;
-    while (p_params && valIsList(p_params) && p_args && valIsList(p_args))
+    if (!gc.enabled || arena.active || gc.root_count > gc.root_capacity) { return 0; }
+    gc.overflow = 0;
+    for (size_t i = 0; i < gc.root_count; i++)
     {
-        Val *param = p_params->first;
-        // parameter beginning with '&' binds the rest of the arguments
-        if ('&' == param->symbol[0])
+        if (gc.roots[i]) { gcMark(gc.roots[i]); }
+    }
+    for (size_t i = 0; i < vm.count; i++)
+    {
+        if (vm.stack[i]) { gcMark(vm.stack[i]); }
+    }
+    // sweep, but only clear the marks if marking was not complete
+    size_t freed = 0;
+    size_t live = 0;
+    for (size_t i = 0; i < heap.count; i++)
+    {
+        LizpChunk *c = heap.chunks[i];
+        for (size_t j = LIZP_CHUNK_FIRST; j < LIZP_CHUNK_SLOTS; j++)
         {
-            if (p_params->rest)
+            unsigned char *tag = &c->tags[j];
+            if (*tag == VK_FREE) { continue; }
+            if (*tag & LIZP_TAG_MARK) { *tag &= ~LIZP_TAG_MARK; }
+            else if (!gc.overflow)
             {
-                // error: not the last parameter
-                EnvPop(env);
-                return NULL;
+                c->refs[j] = 0;
+                slotFree((Val *)c + j);
+                freed++;
             }
-            EnvSet(env, valCopy(param), valCopy(p_args));
-            // p_params and p_args will both be non-null
-            break;
         }
-        // normal parameter
-        EnvSet(env, valCopy(param), valCopy(p_args->first));
-        p_params = p_params->rest;
-        p_args = p_args->rest;
+        live += c->live;
     }
-    // check a parameters-arguments arity mismatch
-    if ((p_params == NULL) != (p_args == NULL))
-    {
-        // error
-        EnvPop(env);
-        return NULL;
-    }
-    Val *result = evaluate(body, env);
-    EnvPop(env);
-    return result;
+    gc.allocated = 0;
+    gc.threshold = (live > LIZP_GC_MIN)? live : LIZP_GC_MIN;
+    return freed;
 }
 
 
-// Functions should return copied values
-static Val *ApplyNative(Val *f, Val *args)
+// Get a value to use as part of a result without copying it if possible.
+// Heap values are shared by adding a reference to them, but they are copied
+// into the arena while it is active, or when they have too many references.
+// In garbage collection mode and for arena values, this is the value itself.
+static Val *valShare(const Val *v)
 {
-    return f->func(args);
+    Val *p = (Val *)v;
+    if (!p || gc.enabled || chunkOf(p)->arena) { return p; }
+    unsigned char *refs = valRefs(p);
+    if (arena.active || *refs == UCHAR_MAX) { return valCopy(p); }
+    (*refs)++;
+    return p;
 }
 
 
-// Macros should return copied values
-static Val *ApplyMacro(Val *m, Val *args, Val *env)
+// Check if a value has no other references than the one its holder has, so
+// that the holder may modify it in place
+static bool valIsUnique(const Val *v)
 {
-    return m->macro(args, env);
+    return v && !gc.enabled && !chunkOf(v)->arena && !*valRefs(v);
 }
 
 
-// Apply functions
-// Return values must not share structure with first, args, or env
-static Val *Apply(Val *first, Val *args, Val *env)
+Val *valAllocKind(ValKind k)
 {
-    if (valIsLambda(first)) { return ApplyLambda(first, args, env); }
-    if (valIsFunc(first)) { return ApplyNative(first, args); }
-    // invalid function
-    return valCreateError(valCreateList(valCopy(first),
-                              valCreateList(valCreateSymbolStr("is not a function"),
-                                       NULL)));
+    Val *p = valAlloc();
+    if (p) { *valTag(p) = k; }
+    return p;
 }
 
 
-// Evaluate each item in a list
-Val *evaluateList(Val *list, Val *env)
+// Make a symbol value with a short name stored inline
+static Val *symbolCreateInline(const char *buf, size_t len)
 {
-    if (!list || !valIsList(list)) { return NULL; }
+    Val *p = valAllocKind(VK_SYMBOL);
+    if (!p) { return NULL; }
+    valSetFlags(p, VF_INLINE);
+    memset(p->name, 0, sizeof(p->name)); // keep padding zero for comparisons
+    memcpy(p->name, buf, len);
+    return p;
+}
 
-    Val *result = valCreateList(NULL, NULL);
-    Val *p_result = result;
-    while (list && valIsList(list))
-    {
-        Val *e = evaluate(list->first, env);
-        if (valIsError(e))
-        {
-            valFreeRec(result);
-            return e;
-        }
 
-        p_result->first = e;
-        if (list->rest)
+// Make a symbol value that takes over a reference to an interned name
+static Val *symbolCreate(char *name)
+{
+    Val *p = valAllocKind(VK_SYMBOL);
+    if (!p)
+    {
+        if (name && !symbolIsStatic(name)) { atomRelease(name); }
+        return NULL;
+    }
+    p->symbol = name;
+    if (arena.active && name && !symbolIsStatic(name))
+    {
+        // the arena releases the name when it is reset
+        if (arena.name_count == arena.name_capacity)
         {
-            p_result->rest = valCreateList(NULL, NULL);
+            char **t = arrayGrow(arena.names, &arena.name_capacity, sizeof(*t));
+            if (!t)
+            {
+                atomRelease(name);
+                p->symbol = NULL;
+                return p;
+            }
+            arena.names = t;
         }
-        p_result = p_result->rest;
-        list = list->rest;
+        arena.names[arena.name_count++] = name;
     }
-
-    return result;
+    return p;
 }
 
 
-// Evaluate a Val value
-// - ast = Abstract Syntax Tree to evaluate
-// - env = environment of symbol-value pairs for bindings
-// Returns the evaluated value
-// NOTE: must only return new values that do not share any
-//       structure with the ast or the env
-Val *evaluate(const Val *ast, Val *env)
+// Free value
+void valFree(Val *p)
 {
-    if (!ast) { return NULL; } // empty list
-    if (valIsInteger(ast)) { return valCopy(ast); } // integers are self-evaluating
-    if (valIsLambda(ast)) { return valCopy(ast); } // lambda values are self-evaluating
-    if (valIsSymbol(ast))
-    {
-        // lookup symbol value
-        Val *val;
-        if (EnvGet(env, ast, &val))
-        {
-            return valCopy(val);
-        }
-        // symbol not found
-        Val *name = valCopy(ast);
-        return valCreateError(
-            valCreateList(name,
-                     valCreateList(valCreateSymbolStr("is undefined"),
-                              NULL)));
-    }
-    // evaluate list application...
-    Val *first = evaluate(ast->first, env);
-    if (valIsError(first)) { return first; }
-    if (valIsMacro(first)) { return ApplyMacro(first, ast->rest, env); }
-    // evaluate rest of elements for normal function application
-    Val *args = evaluateList(ast->rest, env);
-    if (valIsError(args))
+    if (!p || gc.enabled || chunkOf(p)->arena) { return; }
+    unsigned char *refs = valRefs(p);
+    if (*refs)
     {
-        valFreeRec(first);
-        return args;
+        // still in use elsewhere
+        (*refs)--;
+        return;
     }
-    Val *result = Apply(first, args, env);
-    valFreeRec(first);
-    valFreeRec(args);
-    return result;
+    slotFree(p);
 }
 
 
-// Environment Set Function
-// Set a symbol value to be associated with a C function
-// Also, use the form string to always check the arguments before the function
-// is called (see `argsIsMatchForm`).
-bool EnvSetFunc(Val *env, const char *name, LizpFunc *func)
+// Free value recursively
+void valFreeRec(Val *v)
 {
-    if (!env || !name || !func) { return 0; }
-
-    Val *key = valCreateSymbolStr(name);
-    if (!key) { return false; }
-
-    Val *val = valCreateFunc(func);
-    if (!val)
+    if (!v || gc.enabled) { return; }
+    if (*valRefs(v))
     {
-        valFreeRec(key);
-        return 0;
+        // still in use elsewhere
+        valFree(v);
+        return;
     }
-
-    bool success = EnvSet(env, key, val);
-    if (!success)
+    if (valKind(v) == VK_CLOSURE)
     {
-        valFreeRec(key);
-        valFreeRec(val);
+        valFreeRec(v->closure->params);
+        valFreeRec(v->closure->body);
+        valFreeRec(v->closure->self);
+        valFree(v);
+        return;
     }
-
-    return success;
+    if (valKind(v) == VK_SCOPE)
+    {
+        scopeFreeBindings(v->scope);
+        valFree(v);
+        return;
+    }
+    if (valKind(v) == VK_CODE)
+    {
+        LizpCode *code = v->code;
+        for (size_t i = 0; i < code->const_count; i++) { valFreeRec(code->consts[i]); }
+        valFreeRec(code->source);
+        valFree(v);
+        return;
+    }
+    if (valIsRef(v))
+    {
+        // variable reference
+        if (valKind(v) == VK_CAPTURED) { valFreeRec(v->value); }
+        valFreeRec(v->var);
+        valFree(v);
+        return;
+    }
+    if (valIsSymbol(v) || valIsFunc(v) || valIsMacro(v))
+    {
+        // Symbol or C function
+        valFree(v);
+        return;
+    }
+    if (!valIsList(v)) { return; }
+    // List
+    Val *p = v;
+    Val *n;
+    while (p && valIsList(p))
+    {
+        if (*valRefs(p))
+        {
+            // the rest of the list is still in use elsewhere
+            valFree(p);
+            return;
+        }
+        valFreeRec(p->first);
+        n = p->rest;
+        valFree(p);
+        p = n;
+    }
+    return;
 }
 
 
-// Environment set macro extended.
-// Add a custom C macro to the environment.
-bool EnvSetMacro(Val *env, const char *name, LizpMacro *m)
+static bool symbolIsStatic(const char *string)
 {
-    if (!env || !name || !m) { return 0; }
+    return string == const_true;
+}
 
-    Val *key = valCreateSymbolStr(name);
-    if (!key) { return false; }
 
-    Val *val = valCreateMacro(m);
-    if (!val)
+bool valIsEqual(const Val *x, const Val *y)
+{
+    if (x == NULL || y == NULL) { return x == y; }
+    if (valKind(x) == VK_INT)
     {
-        valFreeRec(key);
-        return 0;
+        // Integer equality
+        return valKind(y) == VK_INT && x->integer == y->integer;
     }
-
-    bool success = EnvSet(env, key, val);
-    if (!success)
+    if (valIsSymbol(x))
+    {
+        // Symbol equality. A name is always stored the same way: integers as
+        // VK_INT, short names inline and zero-padded, long names interned.
+        if (!y || *valTag(x) != *valTag(y)) { return 0; } // same kind and storage
+        if (valFlags(x) & VF_INLINE) { return !memcmp(x->name, y->name, sizeof(x->name)); }
+        return x->symbol == y->symbol;
+    }
+    if (valIsList(x))
+    {
+        // List equality
+        const Val *px = x, *py = y;
+        while (px && valIsList(px) && py && valIsList(py))
+        {
+            if (!valIsEqual(px->first, py->first)) { break; }
+            px = px->rest;
+            py = py->rest;
+        }
+        return px == NULL && py == NULL;
+    }
+    if (valIsFunc(x) && valIsFunc(y))
+    {
+        if (valFlags(x) != valFlags(y)) { return 0; }
+        return (valFlags(x) & VF_VECTOR)? x->funcv == y->funcv : x->func == y->func;
+    }
+    if (valIsMacro(x) && valIsMacro(y)) { return x->macro == y->macro; }
+    if (valKind(x) == VK_CODE) { return valKind(y) == VK_CODE && valIsEqual(x->code->source, y->code->source); }
+    if (valKind(x) == VK_CLOSURE)
+    {
+        return valKind(y) == VK_CLOSURE
+            && valIsEqual(x->closure->params, y->closure->params)
+            && valIsEqual(x->closure->body, y->closure->body)
+            && valIsEqual(x->closure->self, y->closure->self);
+    }
+    if (valIsRef(x))
+    {
+        // variable references are equal when they are the same variable
+        if (valKind(x) != valKind(y) || !valIsEqual(x->var, y->var)) { return 0; }
+        if (valKind(x) == VK_LOCAL) { return x->depth == y->depth && x->slot == y->slot; }
+        if (valKind(x) == VK_CAPTURED) { return valIsEqual(x->value, y->value); }
+        return x->cell == y->cell;
+    }
+    return x == y; // scopes are only equal to themselves
+}
+
+
+// Get a value's kind a.k.a type
+ValKind valKind(const Val *v)
+{
+    if (!v) { return VK_LIST; }
+    return *valTag(v) & LIZP_TAG_KIND;
+}
+
+
+// Check if a value is a list
+// NULL is also considered an empty list
+bool valIsList(const Val *p) { return valKind(p) == VK_LIST; }
+
+
+// Check if a value is a symbol
+// Integers are symbols too
+bool valIsSymbol(const Val *p)
+{
+    ValKind k = valKind(p);
+    return k == VK_SYMBOL || k == VK_INT;
+}
+
+
+// Get the name of a symbol.
+// The name of an integer is written into `buf`.
+// Returns NULL for a value that is not a symbol.
+const char *valSymbolName(const Val *v, char buf[LIZP_INT_CHARS])
+{
+    if (valKind(v) == VK_INT)
+    {
+        snprintf(buf, LIZP_INT_CHARS, "%ld", v->integer);
+        return buf;
+    }
+    if (!valIsSymbol(v)) { return NULL; }
+    return (valFlags(v) & VF_INLINE)? v->name : v->symbol;
+}
+
+
+bool valIsFunc(const Val *v) { return v && valKind(v) == VK_FUNC; }
+
+
+bool valIsMacro(const Val *v) { return v && valKind(v) == VK_MACRO; }
+
+
+//  check if a value is a integer symbol
+bool valIsInteger(const Val *v)
+{
+    ValKind k = valKind(v);
+    if (k == VK_INT) { return 1; }
+    if (k != VK_SYMBOL) { return 0; }
+    // string symbols can still spell integers in a non-canonical way, like
+    // "007" or "+5", but all of those begin with a digit, sign, or space
+    char buf[LIZP_INT_CHARS];
+    const char *name = valSymbolName(v, buf);
+    if (!name) { return 0; }
+    unsigned char c = name[0];
+    if (!isdigit(c) && c != '-' && c != '+' && !isspace(c)) { return 0; }
+    const unsigned base = 10;
+    char *end;
+    strtol(name, &end, base);
+    return end && !(*end);
+}
+
+
+// Check if a name is an integer in the form that valWriteToBuffer() writes,
+// and that fits in a long
+static bool nameIsCanonicalInteger(const char *buf, size_t len, long *out)
+{
+    size_t i = 0;
+    bool negative = (len > 1 && buf[0] == '-');
+    if (negative) { i++; }
+    if (i == len) { return 0; }
+    if (buf[i] == '0' && (len - i > 1 || negative)) { return 0; } // no leading zeros or "-0"
+    unsigned long n = 0;
+    const unsigned long limit = negative? -(unsigned long)LONG_MIN : (unsigned long)LONG_MAX;
+    for (; i < len; i++)
+    {
+        if (!isdigit((unsigned char)buf[i])) { return 0; }
+        unsigned d = buf[i] - '0';
+        if (n > (limit - d) / 10) { return 0; } // overflow
+        n = n * 10 + d;
+    }
+    *out = negative? (long)(0 - n) : (long)n;
+    return 1;
+}
+
+
+// Make symbol
+// NOTE: "s" MUST be a free-able string
+// NOTE: "s" is freed after its name is interned
+Val *valCreateSymbol(char *s)
+{
+    if (!s || symbolIsStatic(s)) { return symbolCreate(s); }
+    Val *p = valCreateSymbolCopy(s, strlen(s));
+    free(s);
+    return p;
+}
+
+
+// Make symbol
+// - interns buf to take as a name
+// - empty string -> null []
+Val *valCreateSymbolCopy(const char *buf, size_t len)
+{
+    long n;
+    if (buf && nameIsCanonicalInteger(buf, len, &n)) { return valCreateInteger(n); }
+    if (buf && len <= LIZP_INLINE_CHARS) { return symbolCreateInline(buf, len); }
+    return symbolCreate(atomIntern(buf, len));
+}
+
+
+// Make symbol by copying the null-terminated `str`
+Val *valCreateSymbolStr(const char *str)
+{
+    return valCreateSymbolCopy(str, strlen(str));
+}
+
+
+// Make a symbol for an integer
+Val *valCreateInteger(long n)
+{
+    if (n >= LIZP_SMALL_INT_MIN && n <= LIZP_SMALL_INT_MAX && constants.ints[n - LIZP_SMALL_INT_MIN])
+    {
+        return constants.ints[n - LIZP_SMALL_INT_MIN];
+    }
+    Val *p = valAllocKind(VK_INT);
+    if (p) { p->integer = n; }
+    return p;
+}
+
+
+// Make a proper list.
+// - first: sym or list (null included)
+// - rest: list (NULL included)
+// NOTE: rest must be NULL or a list Val.
+Val *valCreateList(Val *first, Val *rest) {
+    if (!valIsList(rest)) { return NULL; } // allow proper lists only
+    Val *p = valAllocKind(VK_LIST);
+    if (p)
+    {
+        p->first = first;
+        p->rest = rest;
+    }
+    return p;
+}
+
+
+// Create a native function value, which takes either an argument list `f`
+// or an argument vector `fv`
+static Val *valCreateFunc(LizpFunc *f, LizpFuncV *fv, const LizpSignature *sig)
+{
+    Val *p = valAllocKind(VK_FUNC);
+    if (p)
+    {
+        if (fv)
+        {
+            p->funcv = fv;
+            valSetFlags(p, VF_VECTOR);
+        }
+        else { p->func = f; }
+        p->sig = *sig;
+    }
+    return p;
+}
+
+
+static Val *valCreateMacro(LizpMacro *m) 
+{
+    Val *p = valAllocKind(VK_MACRO);
+    if (p) { p->macro = m; }
+    return p;
+}
+
+
+// New copy, with no structure-sharing
+Val *valCopy(const Val *p)
+{
+    if (!p) { return NULL; }
+    if (valKind(p) == VK_INT) { return valCreateInteger(p->integer); }
+    if (valIsSymbol(p) && (valFlags(p) & VF_INLINE))
+    {
+        Val *copy = valAllocKind(VK_SYMBOL);
+        if (copy)
+        {
+            *copy = *p;
+            valSetFlags(copy, VF_INLINE);
+        }
+        return copy;
+    }
+    if (valIsSymbol(p))
+    {
+        // share the interned name
+        char *name = p->symbol;
+        if (name && !symbolIsStatic(name)) { atomOf(name)->refs++; }
+        return symbolCreate(name);
+    }
+    if (valIsFunc(p))
+    {
+        bool vector = valFlags(p) & VF_VECTOR;
+        return valCreateFunc(vector? NULL : p->func, vector? p->funcv : NULL, &p->sig);
+    }
+    if (valIsMacro(p)) { return valCreateMacro(p->macro); }
+    if (valKind(p) == VK_CODE) { return codeCopy(p); }
+    if (valKind(p) == VK_CLOSURE)
+    {
+        const LizpClosure *f = p->closure;
+        return closureCreate(valCopy(f->params), valCopy(f->body), valCopy(f->self));
+    }
+    if (valIsRef(p))
+    {
+        Val *copy = valAllocKind(valKind(p));
+        if (!copy) { return NULL; }
+        *copy = *p;
+        copy->var = valCopy(p->var);
+        if (valKind(p) == VK_CAPTURED) { copy->value = valCopy(p->value); }
+        return copy;
+    }
+    if (!valIsList(p)) { return NULL; }
+    // Copy list
+    Val *copy = valCreateList(valCopy(p->first), NULL);
+    if (copy && (valFlags(p) & VF_ERROR)) { valSetFlags(copy, VF_ERROR); }
+    Val *pcopy = copy;
+    p = p->rest;
+    while (valIsList(p) && p)
+    {
+        pcopy->rest = valCreateList(valCopy(p->first), NULL);
+        pcopy = pcopy->rest;
+        p = p->rest;
+    }
+    return copy;
+}
+
+
+// String needs quotes?
+// Check if a string for a symbol name needs to be quoted
+// in order to be printed "readably".
+bool StrNeedsQuotes(const char *s)
+{
+    while (*s)
+    {
+        switch (*s)
+        {
+            case '[':
+            case ']':
+            case '(':
+            case ')':
+            case '\n':
+            case '\t':
+            case '"':
+            case '\\':
+                return 1;
+            default:
+                if (isspace(*s))
+                {
+                    return 1;
+                }
+        }
+        s++;
+    }
+    return 0;
+}
+
+// Escape a string.
+//   (or is this called "un-escaping"?)
+// Converts escape sequences into the corresponding real ASCII
+// values.
+// Modifies the string in-place
+size_t EscapeStr(char *str, size_t len)
+{
+    if (!str || len <= 0) { return 0; }
+    size_t r = 0; // read index
+    size_t w = 0; // write index
+    while (r < len && str[r])
+    {
+        char c = str[r];
+        if (c == '\\')
+        {
+            r++;
+            c = str[r];
+            switch (c)
+            {
+                case 'a':
+                    c = '\a';
+                    break;
+                case 'b':
+                    c = '\b';
+                    break;
+                case 'e': // escape
+                    c = '\x1b';
+                    break;
+                case 'n':
+                    c = '\n';
+                    break;
+                case 'r':
+                    c = '\r';
+                    break;
+                case 't':
+                    c = '\t';
+                    break;
+                default:
+                    // default result character is itself 
+                    break;
+            }
+        }
+        str[w] = c;
+        r++;
+        w++;
+    }
+    str[w] = '\0';
+    return w;
+}
+
+// Skip space and nested comments within `str`
+// Returns the next index into `str`
+size_t SkipChars(const char *str, size_t len)
+{
+    size_t i = 0;
+    unsigned level = 0; // nesting level
+    while (i < len)
+    {
+        char c = str[i];
+        if (!c) { break; }
+        if (c == '(')
+        {
+            i++;
+            level++;
+            continue;
+        }
+        if (level && c == ')')
+        {
+            i++;
+            level--;
+            continue;
+        }
+        if (!level && !isspace(c)) { break; }
+        i++;
+    }
+    return i;
+}
+
+// Incremental reader.
+// Input is fed in chunks of any size, which may end in the middle of a
+// token, a comment or a list. The lists that are still open are built in
+// place below `hold`, and the part of a token that was cut off is copied
+// into `token`, so the reader only ever buffers one token.
+
+static Val *valErrorNoMemory(void);
+
+
+// token states
+enum {
+    READ_SPACE,     // between tokens
+    READ_SYMBOL,    // in a symbol
+    READ_STRING,    // in a quoted symbol
+    READ_ESCAPE,    // after a backslash in a quoted symbol
+};
+
+
+// character classes
+#define READ_SPACE_CHAR 1   // white space
+#define READ_DELIM 2        // ends a symbol
+#define READ_QUOTED 4       // needs a look in a quoted symbol
+#define READ_COMMENT 8      // needs a look in a comment
+
+
+static const unsigned char read_class[256] = {
+    ['\0'] = READ_DELIM | READ_QUOTED | READ_COMMENT,
+    [' '] = READ_SPACE_CHAR | READ_DELIM, ['\t'] = READ_SPACE_CHAR | READ_DELIM,
+    ['\n'] = READ_SPACE_CHAR | READ_DELIM | READ_QUOTED, ['\v'] = READ_SPACE_CHAR | READ_DELIM,
+    ['\f'] = READ_SPACE_CHAR | READ_DELIM, ['\r'] = READ_SPACE_CHAR | READ_DELIM,
+    ['['] = READ_DELIM, [']'] = READ_DELIM,
+    ['('] = READ_DELIM | READ_COMMENT, [')'] = READ_DELIM | READ_COMMENT,
+    ['"'] = READ_DELIM | READ_QUOTED, ['\\'] = READ_QUOTED,
+};
+
+
+// The characters that stop a scan: those in `mask` of read_class, which
+// for the vector scans are the ones in `any`, and `lo` up to `lo + span`.
+typedef struct ReadSet {
+    char any[8];
+    char lo, span;
+    unsigned char mask;
+} ReadSet;
+
+
+static const ReadSet read_delims = {
+    { 0, ' ', '[', ']', '(', ')', '"', '"' }, '\t', '\r' - '\t', READ_DELIM
+};
+static const ReadSet read_quoted = {
+    { 0, '\n', '"', '\\', 0, 0, 0, 0 }, 0, 0, READ_QUOTED
+};
+static const ReadSet read_comments = {
+    { 0, '(', ')', 0, 0, 0, 0, 0 }, 0, 0, READ_COMMENT
+};
+
+
+// readScan() one character at a time
+static size_t readScanBytes(const char *s, size_t i, size_t n, const ReadSet *set)
+{
+    while (i < n && !(read_class[(unsigned char)s[i]] & set->mask)) { i++; }
+    return i;
+}
+
+
+#ifdef LIZP_SSE2
+
+// Index of the lowest set bit, which must exist
+static int lowestBit(unsigned bits)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(bits);
+#else
+    int k = 0;
+    while (!(bits & 1)) { bits >>= 1; k++; }
+    return k;
+#endif
+}
+
+
+// Bits for which of the 16 characters at `p` are in `set`
+static inline unsigned readMatchSSE2(const char *p, const ReadSet *set)
+{
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    // x - lo is at most span only within the range
+    __m128i d = _mm_sub_epi8(x, _mm_set1_epi8(set->lo));
+    __m128i hit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(set->span)), d);
+    // written out so that the compiler can fold in a constant set
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, _mm_set1_epi8(set->any[0])));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, _mm_set1_epi8(set->any[1])));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, _mm_set1_epi8(set->any[2])));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, _mm_set1_epi8(set->any[3])));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, _mm_set1_epi8(set->any[4])));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, _mm_set1_epi8(set->any[5])));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, _mm_set1_epi8(set->any[6])));
+    hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, _mm_set1_epi8(set->any[7])));
+    return _mm_movemask_epi8(hit);
+}
+
+
+// readScanBytes() 16 characters at a time
+static size_t readScanSSE2(const char *s, size_t i, size_t n, const ReadSet *set)
+{
+    for (; i + 16 <= n; i += 16)
+    {
+        unsigned bits = readMatchSSE2(s + i, set);
+        if (bits) { return i + lowestBit(bits); }
+    }
+    return readScanBytes(s, i, n, set);
+}
+
+#endif /* LIZP_SSE2 */
+
+
+#ifdef LIZP_AVX2
+
+// readScanBytes() 32 characters at a time
+__attribute__((target("avx2")))
+static size_t readScanAVX2(const char *s, size_t i, size_t n, const ReadSet *set)
+{
+    const __m256i lo = _mm256_set1_epi8(set->lo);
+    const __m256i span = _mm256_set1_epi8(set->span);
+    __m256i any[8];
+    for (int k = 0; k < 8; k++) { any[k] = _mm256_set1_epi8(set->any[k]); }
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i d = _mm256_sub_epi8(x, lo);
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, span), d);
+        for (int k = 0; k < 8; k++) { hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(x, any[k])); }
+        unsigned bits = _mm256_movemask_epi8(hit);
+        if (bits) { return i + lowestBit(bits); }
+    }
+    return readScanSSE2(s, i, n, set);
+}
+
+#endif /* LIZP_AVX2 */
+
+
+static size_t readScanFirst(const char *s, size_t i, size_t n, const ReadSet *set);
+
+
+// The scan that suits the CPU, chosen on first use
+static size_t (*read_scan)(const char *s, size_t i, size_t n, const ReadSet *set) = readScanFirst;
+
+
+static size_t readScanFirst(const char *s, size_t i, size_t n, const ReadSet *set)
+{
+#if defined(LIZP_AVX2)
+    read_scan = __builtin_cpu_supports("avx2")? readScanAVX2 : readScanSSE2;
+#elif defined(LIZP_SSE2)
+    read_scan = readScanSSE2;
+#else
+    read_scan = readScanBytes;
+#endif
+    return read_scan(s, i, n, set);
+}
+
+
+// Find the first character of `set` in s[i] to s[n - 1]
+// Returns n when there is none
+static inline size_t readScan(const char *s, size_t i, size_t n, const ReadSet *set)
+{
+#ifdef LIZP_SSE2
+    // most tokens are short, so the first few characters are checked here
+    if (i + 16 <= n)
+    {
+        unsigned bits = readMatchSSE2(s + i, set);
+        if (bits) { return i + lowestBit(bits); }
+        i += 16;
+    }
+#endif
+    return read_scan(s, i, n, set);
+}
+
+
+// Prepare a reader for its first chunk
+// Returns non-zero upon success
+bool lizpReaderInit(LizpReader *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->max_depth = LIZP_READ_DEPTH;
+    r->hold = valCreateList(NULL, NULL);
+    return r->hold != NULL;
+}
+
+
+// Give the reader the next chunk of input, which must stay valid until
+// lizpReaderNext() returns 0. What is left of the previous chunk is dropped.
+void lizpReaderFeed(LizpReader *r, const char *input, size_t length)
+{
+    r->input = input;
+    r->length = length;
+    r->pos = 0;
+}
+
+
+// Tell the reader that there is no more input after the current chunk
+void lizpReaderEnd(LizpReader *r)
+{
+    r->end = 1;
+}
+
+
+void lizpReaderFree(LizpReader *r)
+{
+    valFreeRec(r->hold);
+    free(r->tails);
+    free(r->token);
+    memset(r, 0, sizeof(*r));
+}
+
+
+// Forget the value and the token being read
+static void readerReset(LizpReader *r)
+{
+    valFreeRec(r->hold->first);
+    r->hold->first = NULL;
+    r->depth = 0;
+    r->comment = 0;
+    r->state = READ_SPACE;
+    r->token_length = 0;
+}
+
+
+// Make an error, and give up on the value being read
+static Val *readerError(LizpReader *r, Val *e)
+{
+    readerReset(r);
+    return e;
+}
+
+
+// Append part of the current chunk to the token buffer
+// Returns non-zero upon success
+static bool readerSave(LizpReader *r, size_t start, size_t end)
+{
+    size_t n = end - start;
+    // keep room for EscapeStr()'s terminator
+    while (r->token_length + n + 1 > r->token_capacity)
+    {
+        char *t = arrayGrow(r->token, &r->token_capacity, 1);
+        if (!t) { return 0; }
+        r->token = t;
+    }
+    memcpy(r->token + r->token_length, r->input + start, n);
+    r->token_length += n;
+    return 1;
+}
+
+
+// Make the value of the token that ends at `end` in the current chunk.
+// `start` is where it starts in the chunk, or the start of the chunk if it
+// continues a token from an earlier one.
+static Val *readerToken(LizpReader *r, size_t start, size_t end, bool continued)
+{
+    bool quoted = r->state != READ_SYMBOL;
+    r->state = READ_SPACE;
+    const char *text = r->input + start;
+    size_t len = end - start;
+    if (continued)
+    {
+        if (!readerSave(r, start, end)) { return valErrorNoMemory(); }
+        text = r->token;
+        len = r->token_length;
+        r->token_length = 0;
+    }
+    if (!quoted) { return valCreateSymbolCopy(text, len); }
+    // quoted symbol, without its quotes
+    text++;
+    len -= 2;
+    if (!len) { return NULL; }
+    if (!memchr(text, '\\', len)) { return valCreateSymbolCopy(text, len); }
+    // unescape it in the token buffer, which already holds a continued
+    // token, because the input may be read-only
+    char *buf = r->token + 1;
+    if (!continued)
+    {
+        if (!readerSave(r, start + 1, end - 1)) { return valErrorNoMemory(); }
+        r->token_length = 0;
+        buf = r->token;
+    }
+    return valCreateSymbolCopy(buf, EscapeStr(buf, len));
+}
+
+
+// Put a value that was read into the innermost open list
+// Returns whether it is a whole value instead
+static bool readerAdd(LizpReader *r, Val *v, Val **out)
+{
+    if (!r->depth)
+    {
+        *out = v;
+        return 1;
+    }
+    Val *node = valCreateList(v, NULL);
+    if (!node)
+    {
+        valFreeRec(v);
+        *out = readerError(r, valErrorNoMemory());
+        return 1;
+    }
+    Val **tail = r->tails[r->depth - 1];
+    *tail = node;
+    r->tails[r->depth - 1] = &node->rest;
+    return 0;
+}
+
+
+// Read the next whole value from the input fed so far.
+// Returns 1 and sets `out` when a value or an error was read. After an error
+// the reader starts over with the rest of the chunk. Returns 0 when the
+// chunk is used up, or at the end of the input when nothing is left.
+// In garbage collection mode, `hold` must be a root while the reader is in
+// use. A value that is cut off by lizpArenaEnd() must not be read further.
+bool lizpReaderNext(LizpReader *r, Val **out)
+{
+    const char *in = r->input;
+    size_t i = r->pos;
+    // a token that continues from the last chunk is in the token buffer
+    bool continued = r->state != READ_SPACE;
+    size_t start = i;
+    for (;; i++)
+    {
+        // the input also ends at a null character
+        if (i < r->length && !in[i])
+        {
+            r->length = i;
+            r->end = 1;
+        }
+        if (i == r->length)
+        {
+            if (r->state != READ_SPACE && !r->end)
+            {
+                r->pos = i;
+                if (readerSave(r, start, i)) { return 0; }
+                *out = readerError(r, valErrorNoMemory());
+                return 1;
+            }
+            if (!r->end)
+            {
+                r->pos = i;
+                return 0;
+            }
+            // end of the input
+            r->pos = i;
+            if (r->state == READ_SYMBOL)
+            {
+                if (readerAdd(r, readerToken(r, start, i, continued), out)) { return 1; }
+            }
+            if (r->state != READ_SPACE)
+            {
+                *out = readerError(r, valCreateErrorMessage("read an unterminated string"));
+                return 1;
+            }
+            if (r->depth)
+            {
+                *out = readerError(r, valCreateErrorMessage("reached an unexpected end of input"));
+                return 1;
+            }
+            return 0;
+        }
+        char c = in[i];
+        switch (r->state)
+        {
+            case READ_SYMBOL:
+                if (!(read_class[(unsigned char)c] & READ_DELIM))
+                {
+                    // skip to the end of the symbol or the chunk
+                    i = readScan(in, i + 1, r->length, &read_delims) - 1;
+                    continue;
+                }
+                // the character after the symbol is read next
+                r->pos = i;
+                if (readerAdd(r, readerToken(r, start, i, continued), out)) { return 1; }
+                i--;
+                continue;
+            case READ_ESCAPE:
+                if (c == '\n') { break; }
+                r->state = READ_STRING;
+                continue;
+            case READ_STRING:
+                if (!(read_class[(unsigned char)c] & READ_QUOTED))
+                {
+                    i = readScan(in, i + 1, r->length, &read_quoted) - 1;
+                    continue;
+                }
+                if (c == '\\') { r->state = READ_ESCAPE; }
+                if (c == '\n') { break; }
+                if (c != '"') { continue; }
+                r->pos = i + 1;
+                if (readerAdd(r, readerToken(r, start, i + 1, continued), out)) { return 1; }
+                continue;
+        }
+        if (r->state != READ_SPACE)
+        {
+            // a quoted symbol ran into the end of a line
+            r->pos = i + 1;
+            *out = readerError(r, valCreateErrorMessage("read an unterminated string"));
+            return 1;
+        }
+        if (c == '(')
+        {
+            r->comment++;
+            continue;
+        }
+        if (c == ')' && r->comment)
+        {
+            r->comment--;
+            continue;
+        }
+        if (r->comment)
+        {
+            i = readScan(in, i + 1, r->length, &read_comments) - 1;
+            continue;
+        }
+        if (read_class[(unsigned char)c] & READ_SPACE_CHAR) { continue; }
+        r->pos = i + 1;
+        switch (c)
+        {
+            case ')':
+                *out = readerError(r, valCreateErrorMessage("read an unexpected ')'"));
+                return 1;
+            case '[':
+                {
+                    // the new list is an item of the innermost open list,
+                    // or it is the whole value
+                    Val **tail = &r->hold->first;
+                    if (r->depth)
+                    {
+                        Val *node = valCreateList(NULL, NULL);
+                        if (!node)
+                        {
+                            *out = readerError(r, valErrorNoMemory());
+                            return 1;
+                        }
+                        *r->tails[r->depth - 1] = node;
+                        r->tails[r->depth - 1] = &node->rest;
+                        tail = &node->first;
+                    }
+                    if (r->depth == r->max_depth)
+                    {
+                        *out = readerError(r, valCreateErrorMessage("read lists nested too deeply"));
+                        return 1;
+                    }
+                    if (r->depth == r->capacity)
+                    {
+                        Val ***t = arrayGrow(r->tails, &r->capacity, sizeof(*t));
+                        if (!t)
+                        {
+                            *out = readerError(r, valErrorNoMemory());
+                            return 1;
+                        }
+                        r->tails = t;
+                    }
+                    r->tails[r->depth++] = tail;
+                }
+                continue;
+            case ']':
+                if (!r->depth)
+                {
+                    *out = readerError(r, valCreateErrorMessage("read an unexpected ']'"));
+                    return 1;
+                }
+                if (--r->depth) { continue; }
+                *out = r->hold->first;
+                r->hold->first = NULL;
+                return 1;
+            case '"':
+                r->state = READ_STRING;
+                break;
+            default:
+                r->state = READ_SYMBOL;
+                break;
+        }
+        start = i;
+        continued = 0;
+    }
+}
+
+// Read a value from the input buffer, which ends at `len` or at a null
+// character.
+// Return value: the number of CHARACTERS read.
+// see also: valReadAllFromBuffer()
+size_t valReadOneFromBuffer(const char *str, size_t len, Val **out)
+{
+    if (!out || !str || len <= 0) { return 0; }
+    LizpReader r;
+    if (!lizpReaderInit(&r))
+    {
+        *out = valErrorNoMemory();
+        return 0;
+    }
+    lizpReaderFeed(&r, str, len);
+    lizpReaderEnd(&r);
+    if (!lizpReaderNext(&r, out)) { *out = valCreateErrorMessage("reached an unexpected end of input"); }
+    size_t i = r.pos;
+    lizpReaderFree(&r);
+    return i;
+}
+
+// Read all values from buffer.
+// A single value is returned as it is, and more values as a list of them.
+// An error replaces all of the values.
+// Return value: the number of VALUES read.
+// see also: valReadOneFromBuffer()
+size_t valReadAllFromBuffer(const char *str, size_t len, Val **out)
+{
+    if (!out || !str || len <= 0) { return 0; }
+    LizpReader r;
+    if (!lizpReaderInit(&r))
+    {
+        *out = valErrorNoMemory();
+        return 1;
+    }
+    lizpReaderFeed(&r, str, len);
+    lizpReaderEnd(&r);
+    size_t n = 0; // number of items read
+    Val *list = NULL;
+    Val **tail = &list;
+    Val *e;
+    while (lizpReaderNext(&r, &e))
+    {
+        Val *node = valIsError(e)? NULL : valCreateList(e, NULL);
+        if (!node)
+        {
+            valFreeRec(list);
+            if (!valIsError(e))
+            {
+                valFreeRec(e);
+                e = valErrorNoMemory();
+            }
+            *out = e;
+            lizpReaderFree(&r);
+            return 1;
+        }
+        *tail = node;
+        tail = &node->rest;
+        n++;
+    }
+    lizpReaderFree(&r);
+    if (n == 1)
+    {
+        *out = list->first;
+        valFree(list);
+    }
+    else if (n) { *out = list; }
+    return n;
+}
+
+
+// Map all of a file into memory, so that it is read without a copy
+// Return value: the contents, or NULL if the file can't be mapped, such as
+// when it is empty or is not a regular file
+// see also: lizpUnmapFile()
+const char *lizpMapFile(FILE *f, size_t *length_out)
+{
+#ifdef LIZP_MMAP
+    struct stat st;
+    if (fstat(fileno(f), &st) || !S_ISREG(st.st_mode) || st.st_size <= 0) { return NULL; }
+    if ((unsigned long long)st.st_size > SIZE_MAX) { return NULL; }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (p == MAP_FAILED) { return NULL; }
+    posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+    *length_out = st.st_size;
+    return p;
+#else
+    (void)f;
+    (void)length_out;
+    return NULL;
+#endif
+}
+
+
+// Release the contents from lizpMapFile()
+void lizpUnmapFile(const char *text, size_t length)
+{
+#ifdef LIZP_MMAP
+    if (text) { munmap((void *)text, length); }
+#else
+    (void)text;
+    (void)length;
+#endif
+}
+
+// Write some fixed text for valWriteToBuffer(), cut off at `length`
+// Returns: the length of the whole text
+static size_t valWriteText(const char *txt, char *out, size_t length)
+{
+    size_t len = strlen(txt);
+    if (out) { memcpy(out, txt, (len < length)? len : length); }
+    return len;
+}
+
+
+// Write a value for valWriteToBuffer() after the first `i` characters
+// Returns: the number of chars the value takes, even past `length`
+static size_t valWriteAfter(const Val *v, char *out, size_t length, size_t i, bool readable)
+{
+    if (!out || i >= length) { return valWriteToBuffer(v, NULL, 0, readable); }
+    return valWriteToBuffer(v, out + i, length - i, readable);
+}
+
+
+// Prints p to the given `out` buffer.
+// Does not do null termination.
+// If out is NULL, it just calculates the print length
+// Returns: number of chars written
+size_t valWriteToBuffer(const Val *v, char *out, size_t length, bool readable)
+{
+    // String output count / index
+    size_t i = 0;
+    if (valIsList(v))
+    {
+        if (out && i < length) { out[i] = '['; }
+        i++;
+        if (v)
+        {
+            // first item
+            i += valWriteAfter(v->first, out, length, i, readable);
+            v = v->rest;
+            while (v)
+            {
+                // space
+                if (out && i < length) { out[i] = ' '; }
+                i++;
+                // item
+                i += valWriteAfter(v->first, out, length, i, readable);
+                v = v->rest;
+            }
+        }
+        if (out && i < length) { out[i] = ']'; }
+        i++;
+        return i;
+    }
+    else if (valIsSymbol(v))
+    {
+        // Symbol
+        char buf[LIZP_INT_CHARS];
+        const char *s = valSymbolName(v, buf);
+        bool quoted = readable && StrNeedsQuotes(s);
+        if (!quoted) { return valWriteText(s, out, length); }
+        // Opening quote
+        if (out && i < length) { out[i] = '"'; }
+        i++;
+        // Contents, with escapes
+        for (; *s; s++)
+        {
+            char c = *s;
+            bool esc = true;
+            switch (c)
+            {
+                case '\r': c = 'r'; break;
+                case '\n': c = 'n'; break;
+                case '\t': c = 't'; break;
+                case '"': break;
+                case '\\': break;
+                default: esc = false; break;
+            }
+            if (esc)
+            {
+                if (out && i < length) { out[i] = '\\'; }
+                i++;
+            }
+            if (out && i < length) { out[i] = c; }
+            i++;
+        }
+        // Closing quote
+        if (out && i < length) { out[i] = '"'; }
+        i++;
+        return i;
+    }
+    else if (valIsFunc(v)) {
+        return valWriteText("<native func>", out, length);
+    }
+    else if (valIsMacro(v)) {
+        return valWriteText("<native macro>", out, length);
+    }
+    else if (valIsRef(v)) {
+        return valWriteToBuffer(v->var, out, length, readable);
+    }
+    else if (valKind(v) == VK_CODE) {
+        return valWriteToBuffer(v->code->source, out, length, readable);
+    }
+    else if (valKind(v) == VK_CLOSURE) {
+        // written like the form that made it
+        i = valWriteText("[lambda ", out, length);
+        i += valWriteAfter(v->closure->params, out, length, i, readable);
+        if (out && i < length) { out[i] = ' '; }
+        i++;
+        i += valWriteAfter(v->closure->body, out, length, i, readable);
+        if (out && i < length) { out[i] = ']'; }
+        i++;
+        return i;
+    }
+    else if (valKind(v) == VK_SCOPE) {
+        return valWriteText("<scope>", out, length);
+    }
+    else {
+        return 0;
+    }
+}
+
+// Print value to a new string
+char *valWriteToNewString(const Val *v, bool readable)
+{
+    size_t len1 = valWriteToBuffer(v, NULL, 0, readable);
+    if (len1 <= 0) { return NULL; }
+    char *s = malloc(len1 + 1);
+    if (!s) { return NULL; }
+    size_t len2 = valWriteToBuffer(v, s, len1, readable);
+    if (len1 != len2) { return NULL; } // should not happen unless there is a bug in valWriteToBuffer()
+    s[len2] = '\0';
+    return s;
+}
+
+
+bool valListLengthIsMoreThan(const Val *l, unsigned len)
+{
+    while (l && len)
+    {
+        len--;
+        l = l->rest;
+    }
+    return !len && l;
+}
+
+
+bool valListLengthIsLessThan(const Val *l, unsigned len)
+{
+    while (l && len)
+    {
+        len--;
+        l = l->rest;
+    }
+    return len && !l;
+}
+
+
+// inclusive range
+bool valListLengthIsWithin(const Val *l, unsigned min, unsigned max)
+{
+    return !valListLengthIsLessThan(l, min) && !valListLengthIsMoreThan(l, max);
+}
+
+
+// Get the length of a list.
+// Returns 0 for a non-list value.
+unsigned valListLength(const Val *l)
+{
+    unsigned len = 0;
+    while (l && valIsList(l))
+    {
+        len++;
+        l = l->rest;
+    }
+    return len;
+}
+
+
+long valAsInteger(const Val *v)
+{
+    if (valKind(v) == VK_INT) { return v->integer; }
+    if (!valIsInteger(v)) { return 0; }
+    char buf[LIZP_INT_CHARS];
+    return atol(valSymbolName(v, buf));
+}
+
+
+// Get value right after a symbol in a list
+bool valGetListItemAfterSymbol(Val *list, const char *symname, Val **out)
+{
+    if (!valIsList(list)) { return 0; }
+    while (list)
+    {
+        Val *e = list->first;
+        char buf[LIZP_INT_CHARS];
+        if (valIsSymbol(e) && !strcmp(valSymbolName(e, buf), symname))
+        {
+            // found a spot
+            list = list->rest;
+            if (!list) { return 0; }
+            *out = list->first;
+            return 1;
+        }
+        list = list->rest;
+    }
+    return 0;
+}
+
+
+Val *valGetListIndex(Val *list, size_t index)
+{
+    while (list && index) { list = list->rest; }
+    return list;
+}
+
+
+// Get the Nth item in a list (0-based index)
+Val *NthItem(Val *list, unsigned n)
+{
+    if (!valIsList(list)) { return NULL; }
+    for (; n > 0; n--)
+    {
+        list = list->rest;
+    }
+    return list? list->first : list;
+}
+
+// Check if two values do not share structure
+bool IsSeparate(Val *a, Val *b)
+{
+    // empty list (NULL) is separate from anything
+    if (!a || !b) { return 1; }
+    // the same object is not separate from itself
+    if (a == b) { return 0; }
+    // symbols are separate if they are different values (names are shared
+    // but immutable)
+    if (valIsSymbol(a) && valIsSymbol(b)) { return 1; }
+    // lists are separate if everything under them are separate
+    if (valIsList(a) && valIsList(b))
+    {
+        return IsSeparate(a->first, b->first)
+            && IsSeparate(a->first, b->rest)
+            && IsSeparate(a->rest, b->first)
+            && IsSeparate(a->rest, b->rest);
+    }
+    // symbol and list are separate if the list
+    // (and sublists) never contains the symbol
+    if (valIsSymbol(a))
+    {
+        // swap to make sure `a` is list and `b` is symbol
+        Val *t = b;
+        b = a;
+        a = t;
+    }
+    return IsSeparate(a->first, b)
+        && IsSeparate(a->rest, b);
+}
+
+
+// Check whether a value is considered as true
+bool valIsTrue(const Val *v) { return v != NULL; }
+
+
+Val *valCreateTrue(void) { return constants.t? constants.t : valCreateSymbolStr(const_true); }
+
+
+Val *valCreateFalse(void) { return NULL; }
+
+
+// make a list of the form [error rest...]
+Val *valCreateError(Val *rest)
+{
+    Val *e = valCreateSymbolStr("error");
+    if (!valIsList(rest)) { rest = valCreateList(rest, NULL); }
+    Val *err = valCreateList(e, rest);
+    if (err) { valSetFlags(err, VF_ERROR); }
+    return err;
+}
+
+
+Val *valCreateErrorMessage(const char *msg)
+{
+    return valCreateError(valCreateSymbolStr(msg));
+}
+
+
+// Get a preallocated error, or make it if there is none
+static Val *valGetError(Val *e, const char *msg)
+{
+    return e? e : valCreateErrorMessage(msg);
+}
+
+
+static Val *valErrorNoMemory(void) { return valGetError(errors.no_memory, "out of memory"); }
+
+
+static Val *valErrorDivisionByZero(void) { return valGetError(errors.division_by_zero, "division by zero"); }
+
+
+// Make the constant values
+static void constInit(void)
+{
+    if (constants.chunk || !constBegin()) { return; }
+    errors.no_memory = valCreateErrorMessage("out of memory");
+    errors.division_by_zero = valCreateErrorMessage("division by zero");
+    constants.t = valCreateSymbolStr(const_true);
+    for (long n = LIZP_SMALL_INT_MIN; n <= LIZP_SMALL_INT_MAX; n++)
+    {
+        constants.ints[n - LIZP_SMALL_INT_MIN] = valCreateInteger(n);
+    }
+    constEnd();
+}
+
+// Check whether a value is a lambda value (special list)
+bool valIsLambda(const Val *v)
+{
+    return valKind(v) == VK_CLOSURE;
+}
+
+
+// check if the value is an error made by valCreateError()
+bool valIsError(const Val *v)
+{
+    return v && (valFlags(v) & VF_ERROR);
+}
+
+
+// Replace the current scope's association list with a hash table scope.
+// Does nothing if the table cannot be created.
+static void EnvScopeToTable(Val *env)
+{
+    LizpScope *t = calloc(1, sizeof(*t));
+    if (!t) { return; }
+    Val *scope = valAllocKind(VK_SCOPE);
+    if (!scope)
+    {
+        free(t);
+        return;
+    }
+    scope->scope = t;
+    // make room for every binding before taking any of them
+    size_t n = valListLength(env->first);
+    while (2 * n > t->capacity)
+    {
+        if (!scopeGrow(t))
+        {
+            valFree(scope);
+            return;
+        }
+    }
+    Val *p = env->first;
+    while (p)
+    {
+        Val *pair = p->first;
+        Val *next = p->rest;
+        // newer bindings come first and shadow older ones
+        if (scopeGet(t, pair->first) || !scopeSet(t, pair->first, pair->rest->first))
+        {
+            valFreeRec(pair);
+        }
+        else
+        {
+            valFree(pair->rest);
+            valFree(pair);
+        }
+        valFree(p);
+        p = next;
+    }
+    env->first = scope;
+}
+
+
+// Find the value cell of a key in one scope of an environment
+static Val **ScopeCell(Val *scope, const Val *key)
+{
+    if (valKind(scope) == VK_SCOPE)
+    {
+        LizpBinding *b = scopeGet(scope->scope, key);
+        return b? &b->val : NULL;
+    }
+    for (Val *p = scope; p && valIsList(p); p = p->rest)
+    {
+        Val *pair = p->first;
+        if (pair && valIsList(pair) && valIsEqual(pair->first, key)) { return &pair->rest->first; }
+    }
+    return NULL;
+}
+
+
+// Look up a key in one scope of an environment
+static bool ScopeGet(Val *scope, const Val *key, Val **out)
+{
+    Val **cell = ScopeCell(scope, key);
+    if (cell && out) { *out = *cell; }
+    return cell != NULL;
+}
+
+
+// Set value in environment
+// Key and Val Arguments should by copies of Values
+// A key that is bound in the scope already gets its value replaced in place.
+// In arena mode, bindings made in the outermost scope are moved out of the
+// arena.
+// Returns non-zero upon success
+bool EnvSet(Val *env, Val *key, Val *val)
+{
+    if (!env || !valIsList(env)) { return 0; }
+    bool promote = arena.active && !env->rest;
+    if (promote)
+    {
+        key = arenaPromote(key);
+        val = arenaPromote(val);
+        arena.active = 0;
+    }
+    bool success;
+    Val **cell = ScopeCell(env->first, key);
+    if (cell)
+    {
+        valFreeRec(*cell);
+        *cell = val;
+        valFreeRec(key);
+        success = 1;
+    }
+    else if (valKind(env->first) == VK_SCOPE) { success = scopeSet(env->first->scope, key, val); }
+    else
+    {
+        Val *pair = valCreateList(key, valCreateList(val, NULL));
+        // push key-value pair onto the front of the list
+        if (pair) { env->first = valCreateList(pair, env->first); }
+        success = pair != NULL;
+        // arena scopes stay lists, so that their tables are never leaked
+        if (success && !arena.active && valListLengthIsMoreThan(env->first, LIZP_SCOPE_LINEAR))
+        {
+            EnvScopeToTable(env);
+        }
+    }
+    if (promote) { arena.active = 1; }
+    return success;
+}
+
+
+// Set value in environment
+// Arguments should by copies of Values
+// Returns non-zero upon success
+bool EnvSet_const(Val *env, const Val *key, const Val *val)
+{
+    Val *key_copy = valCopy(key);
+    Val *val_copy = valCopy(val);
+    return EnvSet(env, key_copy, val_copy);
+}
+
+
+// Change the value of the nearest binding of a key in an environment
+// Val should be a copy of a Value
+// Returns non-zero if the key is bound
+static bool EnvReplace(Val *env, const Val *key, Val *val)
+{
+    for (Val *scope = env; scope && valIsList(scope); scope = scope->rest)
+    {
+        Val **cell = ScopeCell(scope->first, key);
+        if (!cell) { continue; }
+        // the outermost scope outlives the arena
+        if (!scope->rest) { val = arenaPromote(val); }
+        valFreeRec(*cell);
+        *cell = val;
+        return 1;
+    }
+    return 0;
+}
+
+
+// Environment Get.
+// Get value in environment, does not return a copy
+// Return value: whether the symbol is present
+bool EnvGet(Val *env, const Val *key, Val **out)
+{
+    if (!env) { return 0; }
+    Val *scope = env;
+    while (scope && valIsList(scope))
+    {
+        if (ScopeGet(scope->first, key, out)) { return 1; }
+        // outer scope
+        scope = scope->rest;
+    }
+    return 0;
+}
+
+
+// push a new context onto the environment
+// Returns non-zero upon success
+bool EnvPush(Val *env)
+{
+    if (!env) { return 0; }
+    Val *outer = valCreateList(env->first, env->rest);
+    if (!outer) { return 0; }
+    env->rest = outer;
+    env->first = NULL;
+    return 1;
+}
+
+
+// pop off the latest context from the environment
+void EnvPop(Val *env)
+{
+    if (!env) { return; }
+    valFreeRec(env->first);
+    Val *pair = env->rest;
+    env->first = pair->first;
+    env->rest = pair->rest;
+    // Only free the one pair
+    valFree(pair);
+}
+
+
+// Bind a value in front of the other bindings of the current scope.
+// Unlike EnvSet, this keeps a list scope a list, so that the position of
+// each binding in a lambda or `let` frame is known ahead of time.
+// Returns non-zero upon success, or leaves the key and value to the caller
+static bool EnvBind(Val *env, Val *key, Val *val)
+{
+    if (valKind(env->first) == VK_SCOPE) { return scopeSet(env->first->scope, key, val); }
+    Val *cell = valCreateList(val, NULL);
+    Val *pair = cell? valCreateList(key, cell) : NULL;
+    Val *node = pair? valCreateList(pair, env->first) : NULL;
+    if (!node)
+    {
+        if (pair) { valFree(pair); }
+        if (cell) { valFree(cell); }
+        return 0;
+    }
+    env->first = node;
+    return 1;
+}
+
+
+// Get the outermost (global) scope's cell of an environment
+Val *EnvGlobal(Val *env)
+{
+    while (env->rest) { env = env->rest; }
+    return env;
+}
+
+
+// Get the value of a VK_LOCAL variable reference
+static bool EnvGetLocal(Val *env, const Val *ref, Val **out)
+{
+    Val *scope = env;
+    for (unsigned d = ref->depth; d && scope; d--) { scope = scope->rest; }
+    if (scope && valIsList(scope->first))
+    {
+        Val *p = scope->first;
+        for (unsigned i = ref->slot; i && p; i--) { p = p->rest; }
+        if (p && valIsEqual(p->first->first, ref->var))
+        {
+            *out = p->first->rest->first;
+            return 1;
+        }
+    }
+    // something was bound in the frame at run time, so search by name
+    return EnvGet(env, ref->var, out);
+}
+
+
+// Bind a name in front of a frame's bindings to the value in `cell`, a list
+// node that the frame takes over
+// Returns non-zero upon success, or frees the cell
+static bool EnvFrameBind(Val *frame, const Val *name, Val *cell)
+{
+    Val *key = valShare(name);
+    Val *pair = cell? valCreateList(key, cell) : NULL;
+    Val *node = pair? valCreateList(pair, frame->first) : NULL;
+    if (!node)
+    {
+        valFreeRec(pair? pair : key);
+        if (!pair) { valFreeRec(cell); }
+        return 0;
+    }
+    frame->first = node;
+    return 1;
+}
+
+
+// Make a frame for a call of the lambda `callee` that binds the parameters
+// to the arguments. The frame sees its own bindings and the global scope,
+// not the caller's scopes. It takes over the `args` list, and the nodes of
+// the list that are not shared become the cells that hold the bound values.
+// Returns NULL upon an arity mismatch, or an error if it runs out of memory
+static Val *EnvFrameBegin(Val *callee, Val *args, Val *env)
+{
+    const LizpClosure *f = callee->closure;
+    unsigned argc = valListLength(args);
+    if (f->rest? argc < f->arity : argc != f->arity)
+    {
+        valFreeRec(args);
+        return NULL;
+    }
+    Val *frame = valCreateList(NULL, EnvGlobal(env));
+    // bound before the parameters, so it is the last slot
+    bool ok = frame && (!f->self ||
+            EnvFrameBind(frame, f->self, valCreateList(valShare(callee), NULL)));
+    // the nodes after a shared node are shared as well
+    Val *shared = args;
+    while (shared && valIsUnique(shared)) { shared = shared->rest; }
+    bool owned = 1;
+    Val *p = args;
+    for (Val *param = f->params; param && ok; param = param->rest)
+    {
+        owned = owned && p != shared;
+        Val *cell = NULL;
+        Val *item = NULL;
+        if (f->rest && !param->rest)
+        {
+            // the rest parameter gets the remaining arguments
+            item = owned? p : valShare(p);
+            if (owned) { p = shared = NULL; }
+        }
+        else if (owned)
+        {
+            cell = p;
+            p = p->rest;
+            cell->rest = NULL;
+        }
+        else
+        {
+            item = valShare(p->first);
+            p = p->rest;
+        }
+        if (!cell && !(cell = valCreateList(item, NULL))) { valFreeRec(item); }
+        ok = EnvFrameBind(frame, param->first, cell);
+    }
+    if (!ok)
+    {
+        // free the arguments that were not bound yet
+        while (owned && p != shared)
+        {
+            Val *n = p->rest;
+            valFreeRec(p->first);
+            valFree(p);
+            p = n;
+        }
+        valFreeRec(shared);
+        if (frame)
+        {
+            valFreeRec(frame->first);
+            valFree(frame);
+        }
+        return valErrorNoMemory();
+    }
+    valFreeRec(shared);
+    return frame;
+}
+
+
+// Free a frame made for a lambda call, but not the global scope below it
+static void EnvFrameEnd(Val *env)
+{
+    if (gc.enabled) { lizpRootPop(1); }
+    valFreeRec(env->first);
+    valFree(env);
+}
+
+
+static Val *vmApply(Val *f, Val *args, Val *env);
+
+
+// Return values may only share structure with first, args, or env through
+// shared values
+static Val *ApplyLambda(Val *first, Val *args, Val *env)
+{
+    Val *body = first->closure->body;
+    if (valKind(body) == VK_CODE) { return vmApply(first, args, env); }
+    // the caller keeps the arguments
+    env = EnvFrameBegin(first, valShare(args), env);
+    if (!env || valIsError(env)) { return env; }
+    if (gc.enabled) { lizpRootPush(env); }
+    Val *result = evaluate(body, env);
+    EnvFrameEnd(env);
+    return result;
+}
+
+
+static bool isArgMatch(char c, Val *arg, Val **err);
+static bool sigIsMatch(const LizpSignature *sig, int argc, Val **argv, Val **err);
+
+
+// most arguments of a native function call that are kept in a local array
+// instead of an allocated one
+#define LIZP_ARGV_LOCAL 8
+
+
+// Call a native function with the `argc` arguments in `argv`, unless they
+// do not match its signature and are not `proven` to.
+// The caller owns the arguments, and frees the ones that are left in argv
+// after the call. Vector functions may take an argument over by setting its
+// slot to NULL. Functions that take an argument list get one that is built
+// from argv.
+// Functions should return copied values
+static Val *ApplyNativeV(Val *f, int argc, Val **argv, bool proven)
+{
+    Val *err;
+    if (!proven && !sigIsMatch(&f->sig, argc, argv, &err)) { return valCreateError(err); }
+    if (valFlags(f) & VF_VECTOR) { return f->funcv(argc, argv); }
+    Val *args = NULL;
+    for (int i = argc; i-- > 0;)
+    {
+        Val *p = valCreateList(argv[i], args);
+        if (!p)
+        {
+            valFreeRec(args);
+            return valErrorNoMemory();
+        }
+        argv[i] = NULL;
+        args = p;
+    }
+    if (gc.enabled) { lizpRootPush(args); }
+    Val *result = f->func(args);
+    if (gc.enabled) { lizpRootPop(1); }
+    valFreeRec(args);
+    return result;
+}
+
+
+// Call a native function with an argument list
+static Val *ApplyNative(Val *f, Val *args)
+{
+    Val *local[LIZP_ARGV_LOCAL];
+    unsigned argc = valListLength(args);
+    Val **argv = (argc <= LIZP_ARGV_LOCAL)? local : malloc(argc * sizeof(*argv));
+    if (!argv) { return valErrorNoMemory(); }
+    unsigned i = 0;
+    for (Val *p = args; i < argc; p = p->rest) { argv[i++] = valShare(p->first); }
+    Val *result = ApplyNativeV(f, (int)argc, argv, 0);
+    while (i > 0) { valFreeRec(argv[--i]); }
+    if (argv != local) { free(argv); }
+    return result;
+}
+
+
+// Macros should return copied values
+static Val *ApplyMacro(Val *m, Val *args, Val *env)
+{
+    return m->macro(args, env);
+}
+
+
+// Apply functions
+// Return values may only share structure with first, args, or env through
+// shared values
+static Val *Apply(Val *first, Val *args, Val *env)
+{
+    if (valIsLambda(first)) { return ApplyLambda(first, args, env); }
+    if (valIsFunc(first)) { return ApplyNative(first, args); }
+    // invalid function
+    return valCreateError(valCreateList(valCopy(first),
+                              valCreateList(valCreateSymbolStr("is not a function"),
+                                       NULL)));
+}
+
+
+// make an error of the form [error name "is undefined"]
+static Val *valCreateErrorUndefined(const Val *name)
+{
+    return valCreateError(
+        valCreateList(valCopy(name),
+                 valCreateList(valCreateSymbolStr("is undefined"),
+                          NULL)));
+}
+
+
+// Evaluate each item in a list
+Val *evaluateList(Val *list, Val *env)
+{
+    if (!list || !valIsList(list)) { return NULL; }
+
+    Val *result = valCreateList(NULL, NULL);
+    if (gc.enabled) { lizpRootPush(result); }
+    Val *p_result = result;
+    while (list && valIsList(list))
+    {
+        Val *e = evaluate(list->first, env);
+        if (valIsError(e))
+        {
+            if (gc.enabled) { lizpRootPop(1); }
+            valFreeRec(result);
+            return e;
+        }
+
+        p_result->first = e;
+        if (list->rest)
+        {
+            p_result->rest = valCreateList(NULL, NULL);
+        }
+        p_result = p_result->rest;
+        list = list->rest;
+    }
+
+    if (gc.enabled) { lizpRootPop(1); }
+    return result;
+}
+
+
+// Evaluate the arguments of a native function call into an array, and call it
+static Val *evaluateNative(Val *f, const Val *list, Val *env)
+{
+    Val *local[LIZP_ARGV_LOCAL];
+    unsigned argc = valListLength(list);
+    Val **argv = (argc <= LIZP_ARGV_LOCAL)? local : malloc(argc * sizeof(*argv));
+    if (!argv) { return valErrorNoMemory(); }
+    Val *result = NULL;
+    unsigned i = 0;
+    for (; list; list = list->rest)
+    {
+        Val *e = evaluate(list->first, env);
+        if (valIsError(e))
+        {
+            result = e;
+            break;
+        }
+        argv[i++] = e;
+        if (gc.enabled) { lizpRootPush(e); }
+    }
+    if (!result) { result = ApplyNativeV(f, (int)argc, argv, 0); }
+    if (gc.enabled) { lizpRootPop(i); }
+    while (i > 0) { valFreeRec(argv[--i]); }
+    if (argv != local) { free(argv); }
+    return result;
+}
+
+
+static bool macroTail(Val *m, Val *args, Val *env, Val **out);
+
+
+// Evaluate a value that is not a list application
+static Val *evaluateAtom(const Val *ast, Val *env)
+{
+    if (!ast) { return NULL; } // empty list
+    if (valIsInteger(ast)) { return valShare(ast); } // integers are self-evaluating
+    switch (valKind(ast))
+    {
+        case VK_LOCAL:
+            {
+                Val *val;
+                if (EnvGetLocal(env, ast, &val)) { return valShare(val); }
+                ast = ast->var;
+            }
+            break;
+        case VK_CAPTURED:
+            return valShare(ast->value);
+        case VK_GLOBAL:
+            return valShare(ast->cell->val);
+        default:
+            break;
+    }
+    if (valIsSymbol(ast))
+    {
+        // lookup symbol value
+        Val *val;
+        if (EnvGet(env, ast, &val))
+        {
+            return valShare(val);
+        }
+        // symbol not found
+        return valCreateErrorUndefined(ast);
+    }
+    // other values are self-evaluating
+    return valShare(ast);
+}
+
+
+// Evaluate a Val value
+// - ast = Abstract Syntax Tree to evaluate
+// - env = environment of symbol-value pairs for bindings
+// Returns the evaluated value
+// NOTE: the result may share structure with the ast or the env, but only
+//       through shared values (see valShare), so it must not be modified
+//       in place. In garbage collection mode, the ast and env must be
+//       reachable from the root stack.
+// Expressions in tail position of core macros and lambda bodies are
+// evaluated by looping instead of recursing. A tail call to a lambda
+// replaces the frame of the previous tail call, so loops written as
+// recursion run in constant C stack and environment depth.
+Val *evaluate(const Val *ast, Val *env)
+{
+    Val *frame = NULL;  // frame of the latest tail call
+    Val *callee = NULL; // lambda of the latest tail call
+    size_t owned = gc.root_count; // root index of frame and callee
+    unsigned lets = 0;  // scopes pushed onto env by `let` in tail position
+    Val *caller = env;
+    unsigned caller_lets = 0; // scopes pushed onto the caller's env
+    Val *result;
+    while (1)
+    {
+        // safepoint: values in use are all reachable from the roots here
+        if (gc.enabled && gc.allocated >= gc.threshold) { lizpGcCollect(); }
+        if (!ast || !valIsList(ast))
+        {
+            result = evaluateAtom(ast, env);
+            break;
+        }
+        // evaluate list application...
+        Val *first = evaluate(ast->first, env);
+        if (valIsError(first))
+        {
+            result = first;
+            break;
+        }
+        if (valIsMacro(first))
+        {
+            bool tail = macroTail(first, ast->rest, env, &result);
+            if (tail && first->macro == let_func) { lets++; }
+            valFreeRec(first);
+            if (!tail) { break; }
+            ast = result;
+            continue;
+        }
+        if (valIsFunc(first))
+        {
+            if (gc.enabled) { lizpRootPush(first); }
+            result = evaluateNative(first, ast->rest, env);
+            if (gc.enabled) { lizpRootPop(1); }
+            valFreeRec(first);
+            break;
+        }
+        // evaluate rest of elements for normal function application
+        if (gc.enabled) { lizpRootPush(first); }
+        Val *args = evaluateList(ast->rest, env);
+        if (valIsError(args))
+        {
+            if (gc.enabled) { lizpRootPop(1); }
+            valFreeRec(first);
+            result = args;
+            break;
+        }
+        if (gc.enabled) { lizpRootPush(args); }
+        if (!valIsLambda(first) || valKind(first->closure->body) == VK_CODE)
+        {
+            result = Apply(first, args, env);
+            if (gc.enabled) { lizpRootPop(2); }
+            valFreeRec(first);
+            valFreeRec(args);
+            break;
+        }
+        // tail call to a lambda
+        Val *next = EnvFrameBegin(first, args, env);
+        if (gc.enabled) { lizpRootPop(2); }
+        if (!next || valIsError(next))
+        {
+            valFreeRec(first);
+            result = next;
+            break;
+        }
+        if (frame)
+        {
+            for (; lets; lets--) { EnvPop(frame); }
+            valFreeRec(frame->first);
+            valFree(frame);
+            valFreeRec(callee);
+        }
+        else
+        {
+            // the new frame may be below the caller's scopes, so they are
+            // kept until the end
+            caller_lets = lets;
+            lets = 0;
+            if (gc.enabled)
+            {
+                lizpRootPush(NULL);
+                lizpRootPush(NULL);
+            }
+        }
+        env = frame = next;
+        callee = first;
+        if (gc.enabled)
+        {
+            // like in lizpRootPush(), the roots may not have fit
+            if (owned + 1 >= gc.root_capacity)
+            {
+                result = valErrorNoMemory();
+                break;
+            }
+            gc.roots[owned] = frame;
+            gc.roots[owned + 1] = callee;
+        }
+        ast = first->closure->body;
+    }
+    for (; lets; lets--) { EnvPop(env); }
+    if (frame)
+    {
+        EnvFrameEnd(frame);
+        if (gc.enabled) { lizpRootPop(1); }
+        valFreeRec(callee);
+    }
+    for (; caller_lets; caller_lets--) { EnvPop(caller); }
+    return result;
+}
+
+
+static bool sigCompile(const char *form, LizpSignature *out);
+
+
+// Bind a native function that takes either an argument list or vector
+static bool EnvSetNative(Val *env, const char *name, const char *form, LizpFunc *func, LizpFuncV *funcv)
+{
+    if (!env || !name) { return 0; }
+
+    LizpSignature sig;
+    if (!sigCompile(form? form : "&v", &sig)) { return 0; }
+
+    Val *key = valCreateSymbolStr(name);
+    if (!key) { return false; }
+
+    Val *val = valCreateFunc(func, funcv, &sig);
+    if (!val)
+    {
+        valFreeRec(key);
+        return 0;
+    }
+
+    bool success = EnvSet(env, key, val);
+    if (!success)
+    {
+        valFreeRec(key);
+        valFreeRec(val);
+    }
+
+    return success;
+}
+
+
+// Environment Set Function
+// Set a symbol value to be associated with a C function
+// Also, use the form string to always check the arguments before the function
+// is called (see `argsIsMatchForm`). The form is compiled once, here. A NULL
+// form accepts any arguments.
+bool EnvSetFunc(Val *env, const char *name, const char *form, LizpFunc *func)
+{
+    if (!func) { return 0; }
+    return EnvSetNative(env, name, form, func, NULL);
+}
+
+
+// Environment Set Function, Vector
+// Like EnvSetFunc(), but the function gets its `argc` arguments in the array
+// `argv` instead of in a list, which saves building the list for each call.
+// The array is only borrowed for the duration of the call. The function may
+// take over an argument by setting its slot to NULL, and then it is
+// responsible for freeing it or using it in its result, which saves copying.
+// An argument that valIsUnique() may even be modified in place.
+bool EnvSetFuncV(Val *env, const char *name, const char *form, LizpFuncV *func)
+{
+    if (!func) { return 0; }
+    return EnvSetNative(env, name, form, NULL, func);
+}
+
+
+// Environment set macro extended.
+// Add a custom C macro to the environment.
+bool EnvSetMacro(Val *env, const char *name, LizpMacro *m)
+{
+    if (!env || !name || !m) { return 0; }
+
+    Val *key = valCreateSymbolStr(name);
+    if (!key) { return false; }
+
+    Val *val = valCreateMacro(m);
+    if (!val)
+    {
+        valFreeRec(key);
+        return 0;
+    }
+
+    bool success = EnvSet(env, key, val);
+    if (!success)
     {
         valFreeRec(key);
         valFreeRec(val);
     }
 
-    return success;
+    return success;
+}
+
+
+// Environment Set Symbol
+bool EnvSetSym(Val *env, const char *sym, Val *v)
+{
+    if (!env || !sym) { return 0; }
+    return EnvSet(env, valCreateSymbolStr(sym), v);
+}
+
+
+void lizpRegisterCore(Val *env)
+{
+    constInit();
+    // macros
+    EnvSetMacro(env, "quote", quote_func);
+    EnvSetMacro(env, "if", if_func);
+    EnvSetMacro(env, "cond", cond_func);
+    EnvSetMacro(env, "do", do_func);
+    EnvSetMacro(env, "^", lambda_func);
+    EnvSetMacro(env, "and", and_func);
+    EnvSetMacro(env, "or", or_func);
+    EnvSetMacro(env, "let", let_func);
+    EnvSetMacro(env, "set!", set_func);
+    // functions
+    EnvSetFuncV(env, "+", "&n", plus_func);
+    EnvSetFuncV(env, "*", "&n", multiply_func);
+    EnvSetFuncV(env, "/", "nn", divide_func);
+    EnvSetFuncV(env, "-", "n(n", subtract_func);
+    EnvSetFuncV(env, "%", "nn", mod_func);
+    EnvSetFuncV(env, "=", "vv&v", equal_func);
+    EnvSetFuncV(env, "<=", "nn&n", increasing_func);
+    EnvSetFuncV(env, ">=", "nn&n", decreasing_func);
+    EnvSetFuncV(env, "<", "nn&n", strictly_increasing_func);
+    EnvSetFuncV(env, ">", "nn&n", strictly_decreasing_func);
+    EnvSetFunc(env, "empty?", "v", empty_q_func);
+    EnvSetFuncV(env, "member?", "vl", member_q_func);
+    EnvSetFunc(env, "symbol?", "v", symbol_q_func);
+    EnvSetFunc(env, "integer?", "v", integer_q_func);
+    EnvSetFunc(env, "list?", "v", list_q_func);
+    EnvSetFunc(env, "lambda?", "v", lambda_q_func);
+    EnvSetFunc(env, "function?", "v", function_q_func);
+    EnvSetFunc(env, "native?", "v", native_q_func);
+    EnvSetFunc(env, "chars", "s", chars_func);
+    EnvSetFunc(env, "symbol", "L", symbol_func);
+    EnvSetFuncV(env, "list", NULL, list_func);
+    EnvSetFuncV(env, "count", "vl", count_func);
+    EnvSetFuncV(env, "position", "vl", position_func);
+    EnvSetFuncV(env, "slice", "ln(n", slice_func);
+    EnvSetFuncV(env, "length", "l", length_func);
+    EnvSetFunc(env, "not", "v", not_func);
+    EnvSetFuncV(env, "nth", "nl", nth_func);
+    EnvSetFuncV(env, "prepend", "vl", prepend_func);
+    EnvSetFuncV(env, "append", "vl", append_func);
+    EnvSetFuncV(env, "without", "vl", without_func);
+}
+
+
+// [reverse list]
+Val *reverse_func(Val *args)
+{
+    // TODO: implement
+    assert(0 && "reverse_func is not implemented");
+    return NULL;
+}
+
+// [concat list.1 (list.N)...]
+Val *concat_func(Val *args)
+{
+    // TODO: implement
+    assert(0 && "concat_func is not implemented");
+    return NULL;
+}
+
+// [join separator (list)...]
+Val *join_func(Val *args)
+{
+    // TODO: implement
+    assert(0 && "join_func is not implemented");
+    return NULL;
+}
+
+// Take over a list to modify it in place: keep its first `n` items, and
+// reuse the nodes that are not shared, but copy the nodes that are
+// Returns the list, or an error if it could not be copied, which releases it
+static Val *listOwn(Val *list, long n)
+{
+    Val **p = &list;
+    for (; n > 0 && *p && valIsUnique(*p); n--) { p = &(*p)->rest; }
+    Val *shared = *p;
+    *p = NULL;
+    for (Val *q = shared; n > 0 && q && valIsList(q); n--, q = q->rest)
+    {
+        Val *item = valShare(q->first);
+        *p = valCreateList(item, NULL);
+        if (!*p)
+        {
+            valFreeRec(item);
+            valFreeRec(list);
+            valFreeRec(shared);
+            return valErrorNoMemory();
+        }
+        p = &(*p)->rest;
+    }
+    valFreeRec(shared);
+    return list;
+}
+
+
+// Drop the first item of a list that was taken over
+static Val *listDropFirst(Val *list)
+{
+    Val *rest = list->rest;
+    if (valIsUnique(list))
+    {
+        valFreeRec(list->first);
+        valFree(list);
+        return rest;
+    }
+    rest = valShare(rest);
+    valFreeRec(list);
+    return rest;
+}
+
+
+// [without item list]
+// Create a list without the given item
+Val *without_func(int argc, Val **argv)
+{
+    (void)argc;
+    Val *item = argv[0];
+    Val *list = listOwn(argv[1], LONG_MAX);
+    argv[1] = NULL;
+    if (valIsError(list)) { return list; }
+    Val **p = &list;
+    while (*p)
+    {
+        Val *n = *p;
+        if (valIsEqual(n->first, item))
+        {
+            *p = n->rest;
+            valFreeRec(n->first);
+            valFree(n);
+            continue;
+        }
+        p = &n->rest;
+    }
+    return list;
+}
+
+// [replace item1 item2 list]
+Val *replace_func(Val *args)
+{
+    // TODO: implement
+    assert(0 && "replace_func is not implemented");
+    return NULL;
+}
+
+// [replaceN item1 item2 list n]
+Val *replace1_func(Val *args)
+{
+    // TODO: implement
+    assert(0 && "replace1_func is not implemented");
+    return NULL;
+}
+
+// [replaceI index item list]
+Val *replaceI_func(Val *args)
+{
+    // TODO: implement
+    assert(0 && "replaceI_func is not implemented");
+    return NULL;
+}
+
+// [zip list.1 (list.N)...]
+Val *zip_func(Val *args)
+{
+    // TODO: implement
+    assert(0 && "zip_func is not implemented");
+    return NULL;
+}
+
+// [append val list]
+Val *append_func(int argc, Val **argv)
+{
+    (void)argc;
+    Val *last = valCreateList(argv[0], NULL);
+    if (!last) { return valErrorNoMemory(); }
+    argv[0] = NULL;
+    // put "last" at the end of the list, which is only copied where it is
+    // shared
+    Val *list = listOwn(argv[1], LONG_MAX);
+    argv[1] = NULL;
+    if (valIsError(list))
+    {
+        valFreeRec(last);
+        return list;
+    }
+    if (!list)
+    {
+        // empty list -> single-item list
+        return last;
+    }
+    Val *p = list;
+    while (p->rest)
+    {
+        p = p->rest;
+    }
+    p->rest = last;
+    return list;
+}
+
+// [prepend val list]
+Val *prepend_func(int argc, Val **argv)
+{
+    (void)argc;
+    Val *list = valCreateList(argv[0], argv[1]);
+    if (!list) { return valErrorNoMemory(); }
+    argv[0] = argv[1] = NULL;
+    return list;
+}
+
+// [+ (integer)...] sum
+Val *plus_func(int argc, Val **argv)
+{
+    long sum = 0;
+    for (int i = 0; i < argc; i++) { sum += valAsInteger(argv[i]); }
+    return valCreateInteger(sum);
+}
+
+// [* (integer)...] product
+Val *multiply_func(int argc, Val **argv)
+{
+    long product = 1;
+    for (int i = 0; i < argc; i++) { product *= valAsInteger(argv[i]); }
+    return valCreateInteger(product);
+}
+
+// [- x:int (y:int)] subtraction
+Val *subtract_func(int argc, Val **argv)
+{
+    long x = valAsInteger(argv[0]);
+    if (argc == 1) { return valCreateInteger(-x); }
+    long y = valAsInteger(argv[1]);
+    return valCreateInteger(x - y);
+}
+
+// [/ x:int y:int] division
+Val *divide_func(int argc, Val **argv)
+{
+    (void)argc;
+    long x = valAsInteger(argv[0]);
+    long y = valAsInteger(argv[1]);
+    if (y == 0)
+    {
+        // division by zero
+        return valErrorDivisionByZero();
+    }
+    return valCreateInteger(x / y);
+}
+
+// [% x:int y:int] modulo
+Val *mod_func(int argc, Val **argv)
+{
+    (void)argc;
+    long x = valAsInteger(argv[0]);
+    long y = valAsInteger(argv[1]);
+    if (y == 0)
+    {
+        // division by zero
+        return valErrorDivisionByZero();
+    }
+    return valCreateInteger(x % y);
+}
+
+// [= x y (expr)...] check equality
+Val *equal_func(int argc, Val **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (!valIsEqual(argv[0], argv[i])) { return valCreateFalse(); }
+    }
+    return valCreateTrue();
+}
+
+// [not expr] boolean not
+Val *not_func(Val *args)
+{
+    return valIsTrue(args->first)? valCreateFalse() : valCreateTrue();
+}
+
+// [symbol? val] check if value is a symbol
+Val *symbol_q_func(Val *args)
+{
+    Val *v = args->first;
+    return !valIsSymbol(v)? valCreateTrue() : valCreateFalse();
+}
+
+// [integer? val] check if value is a integer symbol
+Val *integer_q_func(Val *args)
+{
+    return valIsInteger(args->first)? valCreateTrue() : valCreateFalse();
+}
+
+// [list? val] check if value is a list
+Val *list_q_func(Val *args)
+{
+    return valIsList(args->first)? valCreateTrue() : valCreateFalse();
+}
+
+// [empty? val] check if value is a the empty list
+Val *empty_q_func(Val *args)
+{
+    return (!args->first)? valCreateTrue() : valCreateFalse();
+}
+
+// [nth index list] get the nth item in a list
+Val *nth_func(int argc, Val **argv)
+{
+    (void)argc;
+    long n = valAsInteger(argv[0]);
+    if (n < 0)
+    {
+        // index negative
+        return valCreateErrorMessage("index cannot be negative");
+    }
+    Val *p = argv[1];
+    while (n > 0 && p && valIsList(p))
+    {
+        p = p->rest;
+        n--;
+    }
+    if (p) { return valShare(p->first); }
+    return valCreateErrorMessage("index too big");
+}
+
+// [list (val)...] create list from arguments (variadic)
+Val *list_func(int argc, Val **argv)
+{
+    Val *list = NULL;
+    for (int i = argc; i-- > 0;)
+    {
+        Val *p = valCreateList(valShare(argv[i]), list);
+        if (!p)
+        {
+            valFreeRec(list);
+            return valErrorNoMemory();
+        }
+        list = p;
+    }
+    return list;
+}
+
+// [length list]
+Val *length_func(int argc, Val **argv)
+{
+    (void)argc;
+    return valCreateInteger(valListLength(argv[0]));
+}
+
+// [lambda? v]
+Val *lambda_q_func(Val *args)
+{
+    return valIsLambda(args->first)? valCreateTrue() : valCreateFalse();
+}
+
+// [function? v]
+Val *function_q_func(Val *args)
+{
+    Val *v = args->first;
+    return (valIsFunc(v) || valIsLambda(v))? valCreateTrue() : valCreateFalse();
+}
+
+// [native? v]
+Val *native_q_func(Val *args)
+{
+    return valIsFunc(args->first)? valCreateTrue() : valCreateFalse();
+}
+
+// [<= x y (expr)...] check number order
+Val *increasing_func(int argc, Val **argv)
+{
+    long x = valAsInteger(argv[0]);
+    for (int i = 1; i < argc; i++)
+    {
+        long y = valAsInteger(argv[i]);
+        if (!(x <= y)) { return valCreateFalse(); }
+        x = y;
+    }
+    return valCreateTrue();
+}
+
+// [>= x y (expr)...] check number order
+Val *decreasing_func(int argc, Val **argv)
+{
+    long x = valAsInteger(argv[0]);
+    for (int i = 1; i < argc; i++)
+    {
+        long y = valAsInteger(argv[i]);
+        if (!(x >= y)) { return valCreateFalse(); }
+        x = y;
+    }
+    return valCreateTrue();
+}
+
+// [< x y (expr)...] check number order
+Val *strictly_increasing_func(int argc, Val **argv)
+{
+    long x = valAsInteger(argv[0]);
+    for (int i = 1; i < argc; i++)
+    {
+        long y = valAsInteger(argv[i]);
+        if (!(x < y)) { return valCreateFalse(); }
+        x = y;
+    }
+    return valCreateTrue();
+}
+
+// [> x y (expr)...] check number order
+Val *strictly_decreasing_func(int argc, Val **argv)
+{
+    long x = valAsInteger(argv[0]);
+    for (int i = 1; i < argc; i++)
+    {
+        long y = valAsInteger(argv[i]);
+        if (!(x > y)) { return valCreateFalse(); }
+        x = y;
+    }
+    return valCreateTrue();
+}
+
+// [chars sym] -> list
+Val *chars_func(Val *args)
+{
+    Val *sym = args->first;
+    char buf[LIZP_INT_CHARS];
+    const char *s = valSymbolName(sym, buf);
+    Val *result = valCreateList(valCreateSymbolCopy(s, 1), NULL);
+    s++;
+    Val *p = result;
+    while (*s)
+    {
+        p->rest = valCreateList(valCreateSymbolCopy(s, 1), NULL);
+        p = p->rest;
+        s++;
+    }
+    return result;
+}
+
+// [symbol list] -> symbol
+Val *symbol_func(Val *args)
+{
+    Val *list = args->first;
+    int len = valListLength(list);
+    char *sym = malloc(1 + len);
+    int i = 0;
+    Val *p = list;
+    while (p && valIsList(list))
+    {
+        Val *e = p->first;
+        if (!valIsSymbol(e))
+        {
+            free(sym);
+            return valCreateErrorMessage("list must only contain symbols");
+        }
+        char buf[LIZP_INT_CHARS];
+        sym[i] = valSymbolName(e, buf)[0];
+        i++;
+        p = p->rest;
+    }
+    sym[len] = 0;
+    // ok because sym was created with malloc()
+    return valCreateSymbol(sym);
+}
+
+// [member? item list]
+Val *member_q_func(int argc, Val **argv)
+{
+    (void)argc;
+    Val *item = argv[0];
+    Val *list = argv[1];
+    while (list && valIsList(list))
+    {
+        if (valIsEqual(list->first, item)) { return valCreateTrue(); }
+        list = list->rest;
+    }
+    return valCreateFalse();
+}
+
+// [count item list] -> int
+Val *count_func(int argc, Val **argv)
+{
+    (void)argc;
+    Val *item = argv[0];
+    Val *list = argv[1];
+    long count = 0;
+    while (list && valIsList(list))
+    {
+        if (valIsEqual(list->first, item)) { count++; }
+        list = list->rest;
+    }
+    return valCreateInteger(count);
+}
+
+// [position item list] -> list
+Val *position_func(int argc, Val **argv)
+{
+    (void)argc;
+    Val *item = argv[0];
+    Val *list = argv[1];
+    long i = 0;
+    while (list && valIsList(list))
+    {
+        if (valIsEqual(item, list->first)) { return valCreateInteger(i); }
+        i++;
+        list = list->rest;
+    }
+    return valCreateFalse();
 }
 
-
-// Environment Set Symbol
-bool EnvSetSym(Val *env, const char *sym, Val *v)
+// [slice list start (end)]
+// gets a sublist "slice" inclusive of start and end
+Val *slice_func(int argc, Val **argv)
 {
-    if (!env || !sym) { return 0; }
-    return EnvSet(env, valCreateSymbolStr(sym), v);
+    long start_i = valAsInteger(argv[1]);
+    if (start_i < 0) { return valCreateErrorMessage("start index cannot be negative"); }
+    long end_i = 0;
+    if (argc == 3)
+    {
+        end_i = valAsInteger(argv[2]);
+        if (end_i <= start_i)
+        {
+            return valCreateErrorMessage("start index must be less than the end index");
+        }
+    }
+    Val *list = argv[0];
+    argv[0] = NULL;
+    while (start_i > 0 && list && valIsList(list))
+    {
+        list = listDropFirst(list);
+        start_i--;
+    }
+    if (!list)
+    {
+        // TODO: what causes this error?
+        return NULL;
+    }
+    if (argc == 2)
+    {
+        // [slice list start]
+        // the rest of the list is the result
+        return list;
+    }
+    // [slice list start end]
+    return listOwn(list, 1 + end_i - start_i);
 }
 
+static Val *lambdaCreate(Val *args, Val *env, const Val *self);
 
-void lizpRegisterCore(Val *env)
+
+// Check whether an expression is a lambda form, like [^ [x] x]
+static bool isLambdaForm(const Val *x, Val *env)
 {
-    // macros
-    EnvSetMacro(env, "quote", quote_func);
-    EnvSetMacro(env, "if", if_func);
-    EnvSetMacro(env, "cond", cond_func);
-    EnvSetMacro(env, "do", do_func);
-    EnvSetMacro(env, "^", lambda_func);
-    EnvSetMacro(env, "and", and_func);
-    EnvSetMacro(env, "or", or_func);
-    EnvSetMacro(env, "let", let_func);
-    // functions
-    EnvSetFunc(env, "+", plus_func);
-    EnvSetFunc(env, "*", multiply_func);
-    EnvSetFunc(env, "/", divide_func);
-    EnvSetFunc(env, "-", subtract_func);
-    EnvSetFunc(env, "%", mod_func);
-    EnvSetFunc(env, "=", equal_func);
-    EnvSetFunc(env, "<=", increasing_func);
-    EnvSetFunc(env, ">=", decreasing_func);
-    EnvSetFunc(env, "<", strictly_increasing_func);
-    EnvSetFunc(env, ">", strictly_decreasing_func);
-    EnvSetFunc(env, "empty?", empty_q_func);
-    EnvSetFunc(env, "member?", member_q_func);
-    EnvSetFunc(env, "symbol?", symbol_q_func);
-    EnvSetFunc(env, "integer?", integer_q_func);
-    EnvSetFunc(env, "list?", list_q_func);
-    EnvSetFunc(env, "lambda?", lambda_q_func);
-    EnvSetFunc(env, "function?", function_q_func);
-    EnvSetFunc(env, "native?", native_q_func);
-    EnvSetFunc(env, "chars", chars_func);
-    EnvSetFunc(env, "symbol", symbol_func);
-    EnvSetFunc(env, "list", list_func);
-    EnvSetFunc(env, "count", count_func);
-    EnvSetFunc(env, "position", position_func);
-    EnvSetFunc(env, "slice", slice_func);
-    EnvSetFunc(env, "length", length_func);
-    EnvSetFunc(env, "not", not_func);
-    EnvSetFunc(env, "nth", nth_func);
-    EnvSetFunc(env, "prepend", prepend_func);
-    EnvSetFunc(env, "append", append_func);
-    EnvSetFunc(env, "without", without_func);
+    Val *head;
+    return x && valIsList(x) && valIsSymbol(x->first) && EnvGet(env, x->first, &head)
+        && valIsMacro(head) && head->macro == lambda_func;
 }
 
 
-// [reverse list]
-Val *reverse_func(Val *args)
+// Core macros.
+// Each of these evaluates its arguments up to the one in tail position.
+// Returns non-zero if *out is the expression in tail position, or zero if
+// *out is the result
+
+// Evaluate `let` up to its body, which leaves its scope pushed onto env
+static bool letTail(Val *args, Val *env, Val **out)
 {
-    // TODO: implement
-    assert(0 && "reverse_func is not implemented");
-    return NULL;
+    Val *err;
+    if (!argsIsMatchForm("Lv", args, &err))
+    {
+        *out = valCreateError(err);
+        return 0;
+    }
+    Val *bindings = args->first;
+    Val *body = args->rest->first;
+    // create and check bindings
+    if (!EnvPush(env))
+    {
+        *out = valErrorNoMemory();
+        return 0;
+    }
+    Val *p_binds = bindings;
+    while (p_binds && valIsList(p_binds))
+    {
+        Val *sym = p_binds->first;
+        if (!valIsSymbol(sym) || !p_binds->rest || !valIsList(p_binds->rest))
+        {
+            // invalid symbol or uneven amount of args
+            EnvPop(env);
+            *out = valCreateErrorMessage(
+                    "`let` bindings list must consist of alternating symbols and expressions");
+            return 0;
+        }
+        p_binds = p_binds->rest;
+        Val *expr = p_binds->first;
+        // a lambda can call itself by the name it is bound to
+        Val *val = isLambdaForm(expr, env)? lambdaCreate(expr->rest, env, sym) : evaluate(expr, env);
+        if (valIsError(val))
+        {
+            // eval error
+            EnvPop(env);
+            *out = val;
+            return 0;
+        }
+        Val *key = valShare(sym);
+        if (!key || !EnvBind(env, key, val))
+        {
+            valFreeRec(key);
+            valFreeRec(val);
+            EnvPop(env);
+            *out = valErrorNoMemory();
+            return 0;
+        }
+        p_binds = p_binds->rest;
+    }
+    *out = body;
+    return 1;
 }
 
-// [concat list.1 (list.N)...]
-Val *concat_func(Val *args)
+static bool ifTail(Val *args, Val *env, Val **out)
 {
-    // TODO: implement
-    assert(0 && "concat_func is not implemented");
-    return NULL;
+    Val *err;
+    if (!argsIsMatchForm("vv(v", args, &err))
+    {
+        *out = valCreateError(err);
+        return 0;
+    }
+    if (!valListLengthIsWithin(args, 2, 3))
+    {
+        *out = valCreateErrorMessage("`if` macro requires 2 or 3 expressions");
+        return 0;
+    }
+    Val *f = evaluate(args->first, env);
+    *out = f;
+    if (valIsError(f)) { return 0; } // eval error
+    int t = valIsTrue(f);
+    valFreeRec(f);
+    Val *alt_list = args->rest->rest;
+    // no alternative gives the empty list
+    *out = t? args->rest->first : (alt_list? alt_list->first : NULL);
+    return 1;
 }
 
-// [join separator (list)...]
-Val *join_func(Val *args)
+static bool doTail(Val *args, Val *env, Val **out)
 {
-    // TODO: implement
-    assert(0 && "join_func is not implemented");
-    return NULL;
+    Val *p = args;
+    *out = NULL;
+    while (p && valIsList(p))
+    {
+        if (!p->rest)
+        {
+            *out = p->first;
+            return 1;
+        }
+        Val *e = evaluate(p->first, env);
+        *out = e;
+        if (valIsError(e)) { return 0; } // eval error
+        valFreeRec(e);
+        *out = NULL;
+        p = p->rest;
+    }
+    return 0;
 }
 
-// [without item list]
-// Create a list without the given item
-Val *without_func(Val *args)
+// `and` if is_and, otherwise `or`
+static bool andOrTail(Val *args, Val *env, bool is_and, Val **out)
 {
     Val *err;
-    if (!argsIsMatchForm("vl", args, &err)) { return valCreateError(err); }
-    Val *item = NthItem(args, 0);
-    Val *list = NthItem(args, 1);
-    if (!list) { return NULL; }
-    Val *result = NULL;
-    Val *p = result;
-    while (list)
+    if (!argsIsMatchForm("v&v", args, &err))
     {
-        Val *e = list->first;
-        if (valIsEqual(e, item))
+        *out = valCreateError(err);
+        return 0;
+    }
+    Val *p = args;
+    while (p && valIsList(p))
+    {
+        if (!p->rest)
         {
-            list = list->rest;
-            continue;
+            // the last item gives the result
+            *out = p->first;
+            return 1;
         }
-        if (result)
+        Val *e = evaluate(p->first, env);
+        *out = e;
+        if (valIsError(e)) { return 0; }
+        if (valIsTrue(e) != is_and) { return 0; } // item decides the result
+        valFreeRec(e);
+        p = p->rest;
+    }
+    // malformed list
+    *out = NULL;
+    return 0;
+}
+
+static bool condTail(Val *args, Val *env, Val **out)
+{
+    Val *err;
+    if (!argsIsMatchForm("vv&v", args, &err))
+    {
+        *out = valCreateError(err);
+        return 0;
+    }
+    unsigned n = valListLength(args);
+    if ((n < 2) || (n % 2))
+    {
+        *out = valCreateErrorMessage("`cond` requires an even amount of"
+                                " alternating condition expressions and"
+                                " consequence expressions");
+        return 0;
+    }
+    Val *p = args;
+    while (p && valIsList(p))
+    {
+        Val *e = evaluate(p->first, env);
+        *out = e;
+        if (valIsError(e)) { return 0; }
+        bool t = valIsTrue(e);
+        valFreeRec(e);
+        if (t)
         {
-            p->rest = valCreateList(valCopy(e), NULL);
-            p = p->rest;
-            list = list->rest;
-            continue;
+            *out = p->rest->first;
+            return 1;
         }
-        // This is the first time adding an item
-        result = valCreateList(valCopy(e), NULL);
-        p = result;
-        list = list->rest;
+        p = p->rest;
+        p = p->rest;
     }
+    // no condition matched
+    *out = NULL;
+    return 0;
+}
+
+// Apply a macro value, but stop at the expression in tail position if it is
+// a core macro
+static bool macroTail(Val *m, Val *args, Val *env, Val **out)
+{
+    LizpMacro *f = m->macro;
+    if (f == let_func) { return letTail(args, env, out); }
+    if (f == if_func) { return ifTail(args, env, out); }
+    if (f == cond_func) { return condTail(args, env, out); }
+    if (f == do_func) { return doTail(args, env, out); }
+    if (f == and_func || f == or_func) { return andOrTail(args, env, f == and_func, out); }
+    *out = ApplyMacro(m, args, env);
+    return 0;
+}
+
+// (macro) [let [key val...] expr]
+// create bindings
+Val *let_func(Val *args, Val *env)
+{
+    Val *body;
+    if (!letTail(args, env, &body)) { return body; }
+    // eval body
+    Val *result = evaluate(body, env);
+    // destroy bindings
+    EnvPop(env);
     return result;
 }
 
-// [replace item1 item2 list]
-Val *replace_func(Val *args)
+// (macro) [if condition consequent (alternative)]
+Val *if_func(Val *args, Val *env)
 {
-    // TODO: implement
-    assert(0 && "replace_func is not implemented");
-    return NULL;
+    Val *out;
+    return ifTail(args, env, &out)? evaluate(out, env) : out;
 }
 
-// [replaceN item1 item2 list n]
-Val *replace1_func(Val *args)
+// (macro) [quote expr]
+Val *quote_func(Val *args, Val *env)
 {
-    // TODO: implement
-    assert(0 && "replace1_func is not implemented");
-    return NULL;
+    (void)env;
+    Val *err;
+    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
+    return valShare(args->first);
 }
 
-// [replaceI index item list]
-Val *replaceI_func(Val *args)
+// (macro) [do (expr)...]
+Val *do_func(Val *args, Val *env)
 {
-    // TODO: implement
-    assert(0 && "replaceI_func is not implemented");
-    return NULL;
+    Val *out;
+    return doTail(args, env, &out)? evaluate(out, env) : out;
 }
 
-// [zip list.1 (list.N)...]
-Val *zip_func(Val *args)
+// (macro) [and expr1 (expr)...]
+Val *and_func(Val *args, Val *env)
 {
-    // TODO: implement
-    assert(0 && "zip_func is not implemented");
-    return NULL;
+    Val *out;
+    return andOrTail(args, env, 1, &out)? evaluate(out, env) : out;
 }
 
-// [append val list]
-Val *append_func(Val *args)
+// (macro) [or expr1 (expr)...]
+Val *or_func(Val *args, Val *env)
+{
+    Val *out;
+    return andOrTail(args, env, 0, &out)? evaluate(out, env) : out;
+}
+
+// (macro) [cond (condition result)...] (no nested lists)
+Val *cond_func(Val *args, Val *env)
+{
+    Val *out;
+    return condTail(args, env, &out)? evaluate(out, env) : out;
+}
+
+// (macro) [set! sym expr]
+// change the value of the nearest binding of a symbol
+Val *set_func(Val *args, Val *env)
 {
     Val *err;
-    if (!argsIsMatchForm("vl", args, &err)) { return valCreateError(err); }
-    Val *v = args->first;
-    Val *list = args->rest->first;
-    Val *last = valCreateList(valCopy(v), NULL);
-    if (!list)
+    if (!argsIsMatchForm("sv", args, &err)) { return valCreateError(err); }
+    Val *val = evaluate(args->rest->first, env);
+    if (valIsError(val)) { return val; }
+    Val *result = valShare(val);
+    if (!EnvReplace(env, args->first, val))
     {
-        // empty list -> single-item list
-        return last;
+        valFreeRec(val);
+        valFreeRec(result);
+        return valCreateErrorUndefined(args->first);
+    }
+    return result;
+}
+
+// Lexical addressing.
+// When a lambda is created, the symbols in its body that are variable
+// references are replaced by VK_LOCAL, VK_CAPTURED and VK_GLOBAL values.
+// In the bodies of nested lambdas, only the variables from outside of the
+// lambda being created are captured, because they are out of scope by the
+// time that the nested lambdas are created. The rest are left as names.
+
+// A frame of a lambda being analyzed, with the innermost frame first
+typedef struct LizpLexical {
+    const Val *names;   // list of the names bound in the frame, in order
+    unsigned stride;    // 1 for a parameter list, 2 for a `let` binding list
+    unsigned count;     // how many of the names are bound so far
+    const Val *self;    // name of the lambda, which is bound before the names
+    bool nested;        // whether this is the frame of a nested lambda
+    const struct LizpLexical *outer;
+} LizpLexical;
+
+
+// Find a name in the frames of a lambda being analyzed.
+// A frame is a list with the latest binding first, so the slot of a name is
+// its position counted from the latest binding.
+static bool lexicalFind(const Val *sym, const LizpLexical *lex, unsigned *depth, unsigned *slot)
+{
+    for (unsigned d = 0; lex; lex = lex->outer, d++)
+    {
+        const Val *p = lex->names;
+        bool found = 0;
+        for (unsigned i = 0; i < lex->count && p; i++)
+        {
+            // a later binding of the same name shadows an earlier one
+            if (valIsEqual(p->first, sym))
+            {
+                *slot = lex->count - 1 - i;
+                found = 1;
+            }
+            for (unsigned j = 0; j < lex->stride && p; j++) { p = p->rest; }
+        }
+        if (!found && lex->self && valIsEqual(lex->self, sym))
+        {
+            *slot = lex->count;
+            found = 1;
+        }
+        if (found)
+        {
+            *depth = d;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Make a variable reference
+static Val *lexicalRef(ValKind k, const Val *sym)
+{
+    Val *ref = valAllocKind(k);
+    if (ref) { ref->var = valShare(sym); }
+    return ref;
+}
+
+
+// Resolve a symbol in a lambda body that is created in the environment
+// `env`. Symbols that cannot be resolved now are returned as they are.
+static Val *lexicalResolve(const Val *sym, const LizpLexical *lex, Val *env)
+{
+    unsigned depth, slot;
+    if (lexicalFind(sym, lex, &depth, &slot))
+    {
+        // a variable of a nested lambda is resolved when it is created
+        for (const LizpLexical *l = lex; l; l = l->outer)
+        {
+            if (l->nested) { return valShare(sym); }
+        }
+        Val *ref = lexicalRef(VK_LOCAL, sym);
+        if (ref)
+        {
+            ref->depth = depth;
+            ref->slot = slot;
+        }
+        return ref;
+    }
+    // variables of the enclosing lambdas and lets are captured
+    Val *scope = env;
+    for (; scope->rest; scope = scope->rest)
+    {
+        Val *val;
+        if (ScopeGet(scope->first, sym, &val))
+        {
+            Val *ref = lexicalRef(VK_CAPTURED, sym);
+            if (ref) { ref->value = valShare(val); }
+            return ref;
+        }
     }
-    // Create a new list and put "last" at the end
-    Val *copy = valCopy(list);
-    Val *p = copy;
-    while (p->rest)
+    // globals that are defined already are bound to their binding cell
+    if (valKind(scope->first) == VK_SCOPE)
     {
-        p = p->rest;
+        LizpBinding *b = scopeGet(scope->first->scope, sym);
+        if (b)
+        {
+            Val *ref = lexicalRef(VK_GLOBAL, sym);
+            if (ref) { ref->cell = b; }
+            return ref;
+        }
     }
-    p->rest = last;
-    return copy;
+    return valShare(sym);
 }
 
-// [prepend val list]
-Val *prepend_func(Val *args)
+
+// Get the core macro that the head of a form refers to, if any
+static LizpMacro *lexicalMacro(const Val *head, const LizpLexical *lex, Val *env)
 {
-    Val *err;
-    if (!argsIsMatchForm("vl", args, &err)) { return valCreateError(err); }
-    Val *v = args->first;
-    Val *list = args->rest->first;
-    return valCreateList(valCopy(v), valCopy(list));
+    unsigned depth, slot;
+    if (valKind(head) != VK_SYMBOL || lexicalFind(head, lex, &depth, &slot)) { return NULL; }
+    Val *val;
+    if (!EnvGet(env, head, &val) || !valIsMacro(val)) { return NULL; }
+    return val->macro;
 }
 
-// [+ (integer)...] sum
-Val *plus_func(Val *args)
+
+static Val *lexicalAnalyze(const Val *x, const LizpLexical *lex, Val *env);
+
+
+// Make a list node of the analyzed forms of `x` and `rest`. Analysis gives
+// NULL for a form that is not NULL only when it runs out of memory, and then
+// this frees the other part and gives NULL too.
+static Val *lexicalPrepend(const Val *x, Val *first, const Val *rest, Val *analyzed)
 {
-    Val *err;
-    if (!argsIsMatchForm("&n", args, &err)) { return valCreateError(err); }
-    long sum = 0;
-    Val *p = args;
-    while (p)
+    Val *p = ((x && !first) || (rest && !analyzed))? NULL : valCreateList(first, analyzed);
+    if (!p)
     {
-        Val *e = p->first;
-        if (!valIsInteger(e)) { return valCreateErrorMessage("not an integer number"); }
-        sum += valAsInteger(e);
-        p = p->rest;
+        valFreeRec(first);
+        valFreeRec(analyzed);
     }
-    return valCreateInteger(sum);
+    return p;
 }
 
-// [* (integer)...] product
-Val *multiply_func(Val *args)
+
+// Analyze each item of a list
+static Val *lexicalAnalyzeList(const Val *list, const LizpLexical *lex, Val *env)
 {
-    Val *err;
-    if (!argsIsMatchForm("&n", args, &err)) { return valCreateError(err); }
-    long product = 1;
-    Val *p = args;
-    while (p)
+    Val *result = NULL;
+    Val **tail = &result;
+    for (; list && valIsList(list); list = list->rest)
     {
-        Val *e = p->first;
-        product *= valAsInteger(e);
-        p = p->rest;
+        *tail = lexicalPrepend(list->first, lexicalAnalyze(list->first, lex, env), NULL, NULL);
+        if (!*tail)
+        {
+            valFreeRec(result);
+            return NULL;
+        }
+        tail = &(*tail)->rest;
     }
-    return valCreateInteger(product);
+    return result;
 }
 
-// [- x:int (y:int)] subtraction
-Val *subtract_func(Val *args)
+
+// Analyze a nested lambda form, [^ [params] body], which a `let` binds to
+// `self` if that is not NULL
+static Val *lexicalAnalyzeLambda(const Val *x, const LizpLexical *lex, Val *env, const Val *self)
 {
-    Val *err;
-    if (!argsIsMatchForm("n(n", args, &err)) { return valCreateError(err); }
-    if (!valListLengthIsWithin(args, 1, 2)) { return valCreateErrorMessage("takes 1 or 2 arguments"); }
-    Val *vx = args->first;
-    long x = atol(vx->symbol);
-    if (!args->rest) { return valCreateInteger(-x); }
-    Val *vy = args->rest->first;
-    long y = atol(vy->symbol);
-    return valCreateInteger(x - y);
+    const Val *params = x->rest? x->rest->first : NULL;
+    if (!valIsList(params) || valListLength(x) != 3) { return valShare(x); }
+    LizpLexical frame = { params, 1, valListLength(params), self, 1, lex };
+    const Val *form = x->rest->rest->first;
+    Val *body = lexicalPrepend(form, lexicalAnalyze(form, &frame, env), NULL, NULL);
+    return lexicalPrepend(x->first, valShare(x->first), x->rest,
+                lexicalPrepend(params, valShare(params), x->rest->rest, body));
 }
 
-// [/ x:int y:int] division
-Val *divide_func(Val *args)
+
+// Analyze a `let` form: [let [sym1 expr1 ...] body]
+static Val *lexicalAnalyzeLet(const Val *x, const LizpLexical *lex, Val *env)
 {
-    Val *err;
-    if (!argsIsMatchForm("nn", args, &err)) { return valCreateError(err); }
-    long x = valAsInteger(NthItem(args, 0));
-    long y = valAsInteger(NthItem(args, 1));
-    if (y == 0)
+    const Val *bindings = x->rest? x->rest->first : NULL;
+    unsigned n = valListLength(bindings);
+    if (!valIsList(bindings) || n % 2 || valListLength(x) != 3) { return valShare(x); }
+    // each expression sees the bindings before it
+    LizpLexical frame = { bindings, 2, 0, NULL, 0, lex };
+    Val *result = NULL;
+    Val **tail = &result;
+    for (const Val *p = bindings; p; p = p->rest->rest, frame.count++)
     {
-        // division by zero
-        return valCreateErrorMessage("division by zero");
+        const Val *expr = p->rest->first;
+        bool lambda = expr && valIsList(expr) && lexicalMacro(expr->first, &frame, env) == lambda_func;
+        *tail = lexicalPrepend(p->first, valShare(p->first), p->rest,
+                lexicalPrepend(expr, lambda? lexicalAnalyzeLambda(expr, &frame, env, p->first) :
+                    lexicalAnalyze(expr, &frame, env), NULL, NULL));
+        if (!*tail)
+        {
+            valFreeRec(result);
+            return NULL;
+        }
+        tail = &(*tail)->rest->rest;
     }
-    return valCreateInteger(x / y);
+    const Val *form = x->rest->rest->first;
+    Val *body = lexicalPrepend(form, lexicalAnalyze(form, &frame, env), NULL, NULL);
+    return lexicalPrepend(x->first, valShare(x->first), x->rest,
+                lexicalPrepend(bindings, result, x->rest->rest, body));
 }
 
-// [% x:int y:int] modulo
-Val *mod_func(Val *args)
+
+// Rewrite the variable references in an expression of a lambda body.
+// Returns a new expression, which may share structure with the old one, or
+// NULL for an expression that is not NULL if it runs out of memory.
+static Val *lexicalAnalyze(const Val *x, const LizpLexical *lex, Val *env)
 {
-    Val *err;
-    if (!argsIsMatchForm("nn", args, &err)) { return valCreateError(err); }
-    long x = valAsInteger(NthItem(args, 0));
-    long y = valAsInteger(NthItem(args, 1));
-    if (y == 0)
+    if (valKind(x) == VK_SYMBOL) { return lexicalResolve(x, lex, env); }
+    if (!x || !valIsList(x)) { return valShare(x); }
+    LizpMacro *m = lexicalMacro(x->first, lex, env);
+    if (m == let_func) { return lexicalAnalyzeLet(x, lex, env); }
+    if (m == set_func && valListLength(x) == 3)
     {
-        // division by zero
-        return valCreateErrorMessage("division by zero");
+        // the target stays a name
+        return lexicalPrepend(x->first, valShare(x->first), x->rest,
+                lexicalPrepend(x->rest->first, valShare(x->rest->first), x->rest->rest,
+                    lexicalAnalyzeList(x->rest->rest, lex, env)));
     }
-    return valCreateInteger(x % y);
+    if (m == if_func || m == cond_func || m == do_func || m == and_func || m == or_func)
+    {
+        return lexicalPrepend(x->first, valShare(x->first), x->rest,
+                lexicalAnalyzeList(x->rest, lex, env));
+    }
+    if (m == lambda_func) { return lexicalAnalyzeLambda(x, lex, env, NULL); }
+    // quote and other macros get their arguments as they are
+    if (m) { return valShare(x); }
+    return lexicalAnalyzeList(x, lex, env);
 }
 
-// [= x y (expr)...] check equality
-Val *equal_func(Val *args)
+
+// Bytecode.
+// Each call of a compiled lambda gets a frame on the machine's value stack:
+// the slots for its parameters and `let` variables, then its temporaries.
+enum {
+    OP_NIL,         // push the empty list
+    OP_CONST,       // k: push constant k
+    OP_LOCAL,       // s: push the value in frame slot s
+    OP_MOVE,        // s: push the value in frame slot s, and clear the slot
+    OP_STORE,       // s: pop into frame slot s
+    OP_CAPTURED,    // k: push the value of the VK_CAPTURED constant k
+    OP_GLOBAL,      // k: push the value of the VK_GLOBAL constant k
+    OP_LOOKUP,      // k: push the global value of the symbol constant k
+    OP_POP,         // drop the top value
+    OP_JUMP,        // a: go to a
+    OP_JUMP_FALSE,  // a: pop, and go to a if the value was false
+    OP_AND,         // a: go to a if the top value is false, else pop it
+    OP_OR,          // a: go to a if the top value is true, else pop it
+    OP_CALL,        // n k: call the function below the top n values, which
+                    //      skips its argument check if it is native constant k
+    OP_TAIL_CALL,   // n k: like OP_CALL, but a compiled lambda replaces this frame
+    OP_EVAL,        // k: evaluate constant k in an environment of the
+                    //    frame slots named by constant k + 1, or if constant
+                    //    k + 2 is a name, create the lambda of form k with it
+    OP_RETURN,      // return the top value
+};
+
+
+typedef struct LizpCompiler {
+    LizpCode *code;
+    const Val **names;  // names of the frame slots in scope
+    size_t count;
+    size_t capacity;
+    Val *env;           // environment the lambda is created in
+    const Val *tail_call; // tail call that is being compiled, if any
+    bool failed;        // ran out of memory
+} LizpCompiler;
+
+
+// number of operands of each instruction
+static const unsigned char op_operands[] = {
+    [OP_CONST] = 1, [OP_LOCAL] = 1, [OP_MOVE] = 1, [OP_STORE] = 1,
+    [OP_CAPTURED] = 1, [OP_GLOBAL] = 1, [OP_LOOKUP] = 1, [OP_JUMP] = 1,
+    [OP_JUMP_FALSE] = 1, [OP_AND] = 1, [OP_OR] = 1, [OP_CALL] = 2,
+    [OP_TAIL_CALL] = 2, [OP_EVAL] = 1, [OP_RETURN] = 0,
+};
+
+
+// Compile lambdas to bytecode from now on
+void lizpVmEnable(void) { vm.enabled = 1; }
+
+
+// Append an instruction or operand
+// Returns its position
+static size_t compileEmit(LizpCompiler *c, int op)
 {
-    Val *err;
-    if (!argsIsMatchForm("vv&v", args, &err)) { return valCreateError(err); }
-    Val *f = args->first;
-    Val *p = args->rest;
-    while (p && valIsList(p))
+    LizpCode *code = c->code;
+    if (code->count == code->capacity)
     {
-        if (!valIsEqual(f, p->first)) { return valCreateFalse(); }
-        p = p->rest;
+        int *t = arrayGrow(code->ops, &code->capacity, sizeof(*t));
+        if (!t)
+        {
+            c->failed = 1;
+            return 0;
+        }
+        code->ops = t;
     }
-    return valCreateTrue();
+    code->ops[code->count] = op;
+    return code->count++;
 }
 
-// [not expr] boolean not
-Val *not_func(Val *args)
-{
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    return valIsTrue(args->first)? valCreateFalse() : valCreateTrue();
-}
 
-// [symbol? val] check if value is a symbol
-Val *symbol_q_func(Val *args)
+// Make a jump operand at `at` go to the next instruction
+static void compilePatch(LizpCompiler *c, size_t at)
 {
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    Val *v = args->first;
-    return !valIsSymbol(v)? valCreateTrue() : valCreateFalse();
+    if (!c->failed) { c->code->ops[at] = (int)c->code->count; }
 }
 
-// [integer? val] check if value is a integer symbol
-Val *integer_q_func(Val *args)
-{
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    return valIsInteger(args->first)? valCreateTrue() : valCreateFalse();
-}
 
-// [list? val] check if value is a list
-Val *list_q_func(Val *args)
+// Add a value to the constant pool, which takes ownership of it
+// Returns its index
+static int compileConst(LizpCompiler *c, Val *v)
 {
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    return valIsList(args->first)? valCreateTrue() : valCreateFalse();
+    LizpCode *code = c->code;
+    if (code->const_count == code->const_capacity)
+    {
+        Val **t = arrayGrow(code->consts, &code->const_capacity, sizeof(*t));
+        if (!t)
+        {
+            valFreeRec(v);
+            c->failed = 1;
+            return 0;
+        }
+        code->consts = t;
+    }
+    code->consts[code->const_count] = v;
+    return (int)code->const_count++;
 }
 
-// [empty? val] check if value is a the empty list
-Val *empty_q_func(Val *args)
-{
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    return (!args->first)? valCreateTrue() : valCreateFalse();
-}
 
-// [nth index list] get the nth item in a list
-Val *nth_func(Val *args)
+// Give the next frame slot a name
+static void compileBind(LizpCompiler *c, const Val *name)
 {
-    Val *err;
-    if (!argsIsMatchForm("nl", args, &err)) { return valCreateError(err); }
-    Val *i = args->first;
-    Val *list = args->rest->first;
-    long n = atol(i->symbol);
-    if (n < 0)
-    {
-        // index negative
-        return valCreateErrorMessage("index cannot be negative");
-    }
-    Val *p = list;
-    while (n > 0 && p && valIsList(p))
+    if (c->count == c->capacity)
     {
-        p = p->rest;
-        n--;
+        const Val **t = arrayGrow(c->names, &c->capacity, sizeof(*t));
+        if (!t)
+        {
+            c->failed = 1;
+            return;
+        }
+        c->names = t;
     }
-    if (p) { return valCopy(p->first); }
-    return valCreateErrorMessage("index too big");
+    c->names[c->count++] = name;
+    if (c->count > c->code->locals) { c->code->locals = c->count; }
 }
 
-// [list (val)...] create list from arguments (variadic)
-Val *list_func(Val *args)
-{
-    return valCopy(args);
-}
 
-// [length list]
-Val *length_func(Val *args)
+// Get a list of the names of the frame slots in scope
+static Val *compileNames(LizpCompiler *c)
 {
-    Val *err;
-    if (!argsIsMatchForm("l", args, &err)) { return valCreateError(err); }
-    return valCreateInteger(valListLength(args->first));
+    Val *names = NULL;
+    for (size_t i = c->count; i-- > 0;) { names = valCreateList(valShare(c->names[i]), names); }
+    return names;
 }
 
-// [lambda? v]
-Val *lambda_q_func(Val *args)
+
+// Leave a form to the tree-walking evaluate(), with the frame slots that
+// are in scope bound by name
+static void compileEval(LizpCompiler *c, const Val *x)
 {
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    return valIsLambda(args->first)? valCreateTrue() : valCreateFalse();
+    compileEmit(c, OP_EVAL);
+    compileEmit(c, compileConst(c, valShare(x)));
+    compileConst(c, compileNames(c));
+    compileConst(c, NULL);
 }
 
-// [function? v]
-Val *function_q_func(Val *args)
+
+// Leave the creation of a nested lambda to the tree-walking evaluator, but
+// capture the variables that it uses from outside of this lambda now.
+// `self` is the name that a `let` binds it to, or NULL.
+static void compileLambda(LizpCompiler *c, const Val *x, const Val *self)
 {
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    Val *v = args->first;
-    return (valIsFunc(v) || valIsLambda(v))? valCreateTrue() : valCreateFalse();
+    Val *names = compileNames(c);
+    LizpLexical frame = { names, 1, c->count, NULL, 0, NULL };
+    Val *form = lexicalAnalyzeLambda(x, &frame, c->env, self);
+    if (!form) { c->failed = 1; }
+    compileEmit(c, OP_EVAL);
+    compileEmit(c, compileConst(c, form));
+    compileConst(c, names);
+    compileConst(c, valShare(self));
 }
 
-// [native? v]
-Val *native_q_func(Val *args)
+
+// tail is whether the value of x is returned
+static void compileExpr(LizpCompiler *c, const Val *x, bool tail);
+
+
+// Count the occurrences of a symbol in an expression
+static unsigned compileCount(const Val *x, const Val *sym)
 {
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    return valIsFunc(args->first)? valCreateTrue() : valCreateFalse();
+    if (!x || !valIsList(x)) { return valKind(x) == VK_SYMBOL && valIsEqual(x, sym); }
+    unsigned n = 0;
+    for (; x && valIsList(x); x = x->rest) { n += compileCount(x->first, sym); }
+    return n;
 }
 
-// [<= x y (expr)...] check number order
-Val *increasing_func(Val *args)
+
+static void compileSymbol(LizpCompiler *c, const Val *sym)
 {
-    Val *err;
-    if (!argsIsMatchForm("nn&n", args, &err)) { return valCreateError(err); }
-    Val *f = args->first;
-    long x = atol(f->symbol);
-    Val *p = args->rest;
-    while (p && valIsList(p))
+    for (size_t i = c->count; i-- > 0;)
     {
-        Val *e = p->first;
-        long y = atol(e->symbol);
-        if (!(x <= y)) { return valCreateFalse(); }
-        x = y;
-        p = p->rest;
+        if (valIsEqual(c->names[i], sym))
+        {
+            // the frame ends with a tail call, so a variable that it uses
+            // once is moved instead of shared, and can be taken over
+            bool move = c->tail_call && compileCount(c->tail_call, sym) == 1;
+            compileEmit(c, move? OP_MOVE : OP_LOCAL);
+            compileEmit(c, (int)i);
+            return;
+        }
     }
-    return valCreateTrue();
-}
-
-// [>= x y (expr)...] check number order
-Val *decreasing_func(Val *args)
-{
-    Val *err;
-    if (!argsIsMatchForm("nn&n", args, &err)) { return valCreateError(err); }
-    Val *f = args->first;
-    long x = atol(f->symbol);
-    Val *p = args->rest;
-    while (p && valIsList(p))
+    Val *ref = lexicalResolve(sym, NULL, c->env);
+    if (!ref)
     {
-        Val *e = p->first;
-        long y = atol(e->symbol);
-        if (!(x >= y)) { return valCreateFalse(); }
-        x = y;
-        p = p->rest;
+        c->failed = 1;
+        return;
     }
-    return valCreateTrue();
+    ValKind k = valKind(ref);
+    compileEmit(c, (k == VK_CAPTURED)? OP_CAPTURED : (k == VK_GLOBAL)? OP_GLOBAL : OP_LOOKUP);
+    compileEmit(c, compileConst(c, ref));
 }
 
-// [< x y (expr)...] check number order
-Val *strictly_increasing_func(Val *args)
+
+// Check whether an expression is a lambda form whose head is not shadowed
+static bool compileIsLambda(LizpCompiler *c, const Val *x)
 {
-    Val *err;
-    if (!argsIsMatchForm("nn&n", args, &err)) { return valCreateError(err); }
-    Val *f = args->first;
-    long x = atol(f->symbol);
-    Val *p = args->rest;
-    while (p && valIsList(p))
+    if (!x || !valIsList(x) || valKind(x->first) != VK_SYMBOL) { return 0; }
+    for (size_t i = 0; i < c->count; i++)
     {
-        Val *e = p->first;
-        long y = atol(e->symbol);
-        if (!(x < y)) { return valCreateFalse(); }
-        x = y;
-        p = p->rest;
+        if (valIsEqual(c->names[i], x->first)) { return 0; }
     }
-    return valCreateTrue();
+    return isLambdaForm(x, c->env);
 }
 
-// [> x y (expr)...] check number order
-Val *strictly_decreasing_func(Val *args)
+
+// Compile a `let` form, unless it is malformed
+static bool compileLet(LizpCompiler *c, const Val *x, bool tail)
 {
-    Val *err;
-    if (!argsIsMatchForm("nn&n", args, &err)) { return valCreateError(err); }
-    Val *f = args->first;
-    long x = atol(f->symbol);
-    Val *p = args->rest;
-    while (p && valIsList(p))
+    const Val *bindings = x->rest->first;
+    if (!bindings || !valIsList(bindings) || valListLength(x) != 3) { return 0; }
+    for (const Val *p = bindings; p; p = p->rest->rest)
     {
-        Val *e = p->first;
-        long y = atol(e->symbol);
-        if (!(x > y)) { return valCreateFalse(); }
-        x = y;
-        p = p->rest;
+        if (!valIsSymbol(p->first) || !p->rest) { return 0; }
     }
-    return valCreateTrue();
-}
-
-// [chars sym] -> list
-Val *chars_func(Val *args)
-{
-    Val *err;
-    if (!argsIsMatchForm("s", args, &err)) { return valCreateError(err); }
-    Val *sym = args->first;
-    char *s = sym->symbol;
-    Val *result = valCreateList(valCreateSymbolCopy(s, 1), NULL);
-    s++;
-    Val *p = result;
-    while (*s)
+    size_t count = c->count;
+    for (const Val *p = bindings; p; p = p->rest->rest)
     {
-        p->rest = valCreateList(valCreateSymbolCopy(s, 1), NULL);
-        p = p->rest;
-        s++;
+        // each expression sees the bindings before it
+        const Val *expr = p->rest->first;
+        if (compileIsLambda(c, expr)) { compileLambda(c, expr, p->first); }
+        else { compileExpr(c, expr, 0); }
+        compileBind(c, p->first);
+        compileEmit(c, OP_STORE);
+        compileEmit(c, (int)c->count - 1);
     }
-    return result;
+    compileExpr(c, x->rest->rest->first, tail);
+    c->count = count;
+    return 1;
 }
 
-// [symbol list] -> symbol
-Val *symbol_func(Val *args)
+
+// Compile a `set!` of a frame slot. Other variables are left to the
+// tree-walking evaluator.
+static bool compileSet(LizpCompiler *c, const Val *x)
 {
-    Val *err;
-    if (!argsIsMatchForm("L", args, &err)) { return valCreateError(err); }
-    Val *list = args->first;
-    int len = valListLength(list);
-    char *sym = malloc(1 + len);
-    int i = 0;
-    Val *p = list;
-    while (p && valIsList(list))
+    const Val *sym = x->rest->first;
+    for (size_t i = c->count; i-- > 0;)
     {
-        Val *e = p->first;
-        if (!valIsSymbol(e))
+        if (valIsEqual(c->names[i], sym))
         {
-            free(sym);
-            return valCreateErrorMessage("list must only contain symbols");
+            compileExpr(c, x->rest->rest->first, 0);
+            compileEmit(c, OP_STORE);
+            compileEmit(c, (int)i);
+            compileEmit(c, OP_LOCAL);
+            compileEmit(c, (int)i);
+            return 1;
         }
-        sym[i] = e->symbol[0];
-        i++;
-        p = p->rest;
     }
-    sym[len] = 0;
-    // ok because sym was created with malloc()
-    return valCreateSymbol(sym);
+    return 0;
 }
 
-// [member? item list]
-Val *member_q_func(Val *args)
-{
-    Val *err;
-    if (!argsIsMatchForm("vl", args, &err)) { return valCreateError(err); }
-    Val *item = args->first;
-    Val *list = args->rest->first;
-    while (list && valIsList(list))
-    {
-        if (valIsEqual(list->first, item)) { return valCreateTrue(); }
-        list = list->rest;
-    }
-    return valCreateFalse();
-}
 
-// [count item list] -> int
-Val *count_func(Val *args)
+// Undo the moves of frame slots in the code after `start` if it evaluates a
+// form with the tree-walking evaluator, because that gets the whole frame
+static void compileUnmove(LizpCompiler *c, size_t start)
 {
-    Val *err;
-    if (!argsIsMatchForm("vl", args, &err)) { return valCreateError(err); }
-    Val *item = args->first;
-    Val *list = args->rest->first;
-    long count = 0;
-    while (list && valIsList(list))
+    // failed code is thrown away, and may be missing operands
+    if (c->failed) { return; }
+    int *ops = c->code->ops;
+    size_t end = c->code->count;
+    bool eval = 0;
+    for (size_t pc = start; pc < end; pc += 1 + op_operands[ops[pc]]) { eval |= (ops[pc] == OP_EVAL); }
+    if (!eval) { return; }
+    for (size_t pc = start; pc < end; pc += 1 + op_operands[ops[pc]])
     {
-        if (valIsEqual(list->first, item)) { count++; }
-        list = list->rest;
+        if (ops[pc] == OP_MOVE) { ops[pc] = OP_LOCAL; }
     }
-    return valCreateInteger(count);
 }
 
-// [position item list] -> list
-Val *position_func(Val *args)
+
+// Check if the arguments of a call always match a native signature.
+// Only literals have a type that is known before they are evaluated.
+static bool compileIsProven(const LizpSignature *sig, const Val *args)
 {
-    Val *err;
-    if (!argsIsMatchForm("vl", args, &err)) { return valCreateError(err); }
-    Val *item = args->first;
-    Val *list = args->rest->first;
-    long i = 0;
-    while (list && valIsList(list))
+    unsigned i = 0;
+    for (; args; args = args->rest, i++)
     {
-        if (valIsEqual(item, list->first)) { return valCreateInteger(i); }
-        i++;
-        list = list->rest;
+        char t = sig->types[(i < sig->count)? i : sig->count];
+        if (!t) { return 0; }
+        const Val *a = args->first;
+        if (t == 'v') { continue; }
+        if (a && !valIsInteger(a)) { return 0; }
+        if (!isArgMatch(t, (Val *)a, NULL)) { return 0; }
     }
-    return valCreateFalse();
+    return i >= sig->min;
 }
 
-// [slice list start (end)]
-// gets a sublist "slice" inclusive of start and end
-Val *slice_func(Val *args)
+
+static void compileList(LizpCompiler *c, const Val *x, bool tail)
 {
-    Val *err;
-    if (!argsIsMatchForm("ln(n", args, &err)) { return valCreateError(err); }
-    Val *list = args->first;
-    Val *start = args->rest->first;
-    long start_i = atol(start->symbol);
-    if (start_i < 0) { return valCreateErrorMessage("start index cannot be negative"); }
-    if (!args->rest->rest)
+    // core macros that are not shadowed are compiled
+    LizpMacro *m = NULL;
+    Val *native = NULL;
+    Val *head = x->first;
+    if (valKind(head) == VK_SYMBOL)
     {
-        // [slice list start]
-        while (start_i > 0 && list && valIsList(list))
+        bool local = 0;
+        for (size_t i = 0; i < c->count && !local; i++) { local = valIsEqual(c->names[i], head); }
+        Val *val;
+        if (!local && EnvGet(c->env, head, &val))
         {
-            list = list->rest;
-            start_i--;
+            if (valIsMacro(val)) { m = val->macro; }
+            else if (valIsFunc(val) && compileIsProven(&val->sig, x->rest)) { native = val; }
         }
-        if (!list)
+    }
+    if (!m)
+    {
+        // function call
+        unsigned n = 0;
+        const Val *outer = c->tail_call;
+        if (tail) { c->tail_call = x; }
+        size_t start = c->code->count;
+        compileExpr(c, head, 0);
+        for (const Val *p = x->rest; p; p = p->rest, n++) { compileExpr(c, p->first, 0); }
+        c->tail_call = outer;
+        if (tail) { compileUnmove(c, start); }
+        compileEmit(c, tail? OP_TAIL_CALL : OP_CALL);
+        compileEmit(c, n);
+        compileEmit(c, native? compileConst(c, valShare(native)) : -1);
+        return;
+    }
+    const Val *args = x->rest;
+    unsigned n = valListLength(args);
+    if (m == quote_func && n == 1)
+    {
+        compileEmit(c, OP_CONST);
+        compileEmit(c, compileConst(c, valShare(args->first)));
+    }
+    else if (m == if_func && (n == 2 || n == 3))
+    {
+        compileExpr(c, args->first, 0);
+        compileEmit(c, OP_JUMP_FALSE);
+        size_t to_else = compileEmit(c, 0);
+        compileExpr(c, args->rest->first, tail);
+        compileEmit(c, OP_JUMP);
+        size_t to_end = compileEmit(c, 0);
+        compilePatch(c, to_else);
+        if (n == 3) { compileExpr(c, args->rest->rest->first, tail); }
+        else { compileEmit(c, OP_NIL); }
+        compilePatch(c, to_end);
+    }
+    else if (m == cond_func && n >= 2 && n % 2 == 0)
+    {
+        size_t to_end[n / 2];
+        unsigned i = 0;
+        for (const Val *p = args; p; p = p->rest->rest)
         {
-            // TODO: what causes this error?
-            return NULL;
+            compileExpr(c, p->first, 0);
+            compileEmit(c, OP_JUMP_FALSE);
+            size_t to_next = compileEmit(c, 0);
+            compileExpr(c, p->rest->first, tail);
+            compileEmit(c, OP_JUMP);
+            to_end[i++] = compileEmit(c, 0);
+            compilePatch(c, to_next);
         }
-        Val *result = valCreateList(valCopy(list->first), NULL);
-        list = list->rest;
-        Val *p_result = result;
-        while (list && valIsList(list))
+        // no condition matched
+        compileEmit(c, OP_NIL);
+        while (i) { compilePatch(c, to_end[--i]); }
+    }
+    else if (m == do_func)
+    {
+        if (!args) { compileEmit(c, OP_NIL); }
+        for (const Val *p = args; p; p = p->rest)
         {
-            p_result->rest = valCreateList(valCopy(list->first), NULL);
-            p_result = p_result->rest;
-            list = list->rest;
+            compileExpr(c, p->first, tail && !p->rest);
+            if (p->rest) { compileEmit(c, OP_POP); }
         }
-        return result;
     }
-    // [slice list start end]
-    Val *end = args->rest->rest->first;
-    long end_i = atol(end->symbol);
-    if (end_i <= start_i)
+    else if ((m == and_func || m == or_func) && n >= 1)
     {
-        return valCreateErrorMessage("start index must be less than the end index");
+        size_t to_end[n];
+        unsigned i = 0;
+        for (const Val *p = args; p; p = p->rest)
+        {
+            compileExpr(c, p->first, tail && !p->rest);
+            if (!p->rest) { break; }
+            compileEmit(c, (m == and_func)? OP_AND : OP_OR);
+            to_end[i++] = compileEmit(c, 0);
+        }
+        while (i) { compilePatch(c, to_end[--i]); }
     }
-    while (start_i > 0 && list && valIsList(list))
+    else if (m == lambda_func) { compileLambda(c, x, NULL); }
+    else if (!(m == let_func && n == 2 && compileLet(c, x, tail)) &&
+             !(m == set_func && n == 2 && compileSet(c, x)))
     {
-        list = list->rest;
-        start_i--;
+        // other macros and malformed forms
+        compileEval(c, x);
     }
-    if (!list)
+}
+
+
+static void compileExpr(LizpCompiler *c, const Val *x, bool tail)
+{
+    if (!x)
     {
-        // TODO: what error is this?
-        return NULL;
+        compileEmit(c, OP_NIL);
+        return;
     }
-    Val *result = valCreateList(valCopy(list->first), NULL);
-    list = list->rest;
-    Val *p_result = result;
-    long i = end_i - start_i;
-    while (i > 0 && list && valIsList(list))
+    ValKind k = valKind(x);
+    if (k == VK_CAPTURED || k == VK_GLOBAL)
     {
-        p_result->rest = valCreateList(valCopy(list->first), NULL);
-        p_result = p_result->rest;
-        list = list->rest;
-        i--;
+        // captured when an enclosing lambda was created
+        compileEmit(c, (k == VK_CAPTURED)? OP_CAPTURED : OP_GLOBAL);
+        compileEmit(c, compileConst(c, valShare(x)));
+        return;
     }
-    return result;
+    if (valIsInteger(x) || (!valIsSymbol(x) && !valIsList(x)))
+    {
+        // self-evaluating
+        compileEmit(c, OP_CONST);
+        compileEmit(c, compileConst(c, valShare(x)));
+        return;
+    }
+    if (valIsSymbol(x))
+    {
+        compileSymbol(c, x);
+        return;
+    }
+    compileList(c, x, tail);
 }
 
-// (macro) [let [key val...] expr]
-// create bindings
-Val *let_func(Val *args, Val *env)
+
+// Compile the body of a lambda that is created in the environment `env`,
+// and that sees itself as `self` if that is not NULL
+// Returns a VK_CODE value, or NULL if the lambda cannot be compiled
+static Val *lizpCompile(Val *params, Val *body, Val *env, const Val *self)
 {
-    Val *err;
-    if (!argsIsMatchForm("Lv", args, &err)) { return valCreateError(err); }
-    Val *bindings = args->first;
-    Val *body = args->rest->first;
-    // create and check bindings
-    EnvPush(env);
-    Val *p_binds = bindings;
-    while (p_binds && valIsList(p_binds))
+    LizpCode *code = calloc(1, sizeof(*code));
+    if (!code) { return NULL; }
+    LizpCompiler c = { code, NULL, 0, 0, env, NULL, 0 };
+    for (Val *p = params; p; p = p->rest)
     {
-        Val *sym = p_binds->first;
-        if (!valIsSymbol(sym) || !p_binds->rest || !valIsList(p_binds->rest))
-        {
-            // invalid symbol or uneven amount of args
-            EnvPop(env);
-            return valCreateErrorMessage(
-                    "`let` bindings list must consist of alternating symbols and expressions");
-        }
-        p_binds = p_binds->rest;
-        Val *expr = p_binds->first;
-        Val *val = evaluate(expr, env);
-        if (valIsError(val))
+        char buf[LIZP_INT_CHARS];
+        if ('&' == valSymbolName(p->first, buf)[0])
         {
-            // eval error
-            EnvPop(env);
-            return val;
+            // a rest parameter must be the last one
+            c.failed |= p->rest != NULL;
+            code->rest = 1;
         }
-        EnvSet(env, valCopy(sym), val);
-        p_binds = p_binds->rest;
+        compileBind(&c, p->first);
     }
-    // eval body
-    Val *result = evaluate(body, env);
-    // destroy bindings
-    EnvPop(env);
-    return result;
+    code->params = c.count;
+    if (self)
+    {
+        compileBind(&c, self);
+        code->self = 1;
+    }
+    compileExpr(&c, body, 1);
+    compileEmit(&c, OP_RETURN);
+    free(c.names);
+    code->source = valShare(body);
+    if (c.failed)
+    {
+        for (size_t i = 0; i < code->const_count; i++) { valFreeRec(code->consts[i]); }
+        valFreeRec(code->source);
+        codeFree(code);
+        return NULL;
+    }
+    return codeCreate(code);
 }
 
-// (macro) [if condition consequent (alternative)]
-Val *if_func(Val *args, Val *env)
+
+static bool vmPush(Val *v)
 {
-    Val *err;
-    if (!argsIsMatchForm("vv(v", args, &err)) { return valCreateError(err); }
-    if (!valListLengthIsWithin(args, 2, 3)) { return valCreateErrorMessage("`if` macro requires 2 or 3 expressions"); }
-    Val *f = evaluate(args->first, env);
-    if (valIsError(f)) { return f; } // eval error
-    int t = valIsTrue(f);
-    valFreeRec(f);
-    if (t)
+    if (vm.count == vm.capacity)
     {
-        Val *consequent = args->rest->first;
-        return evaluate(consequent, env);
+        Val **t = arrayGrow(vm.stack, &vm.capacity, sizeof(*t));
+        if (!t)
+        {
+            valFreeRec(v);
+            return 0;
+        }
+        vm.stack = t;
     }
-    Val *alt_list = args->rest->rest;
-    if (!alt_list) { return NULL; } // no alternative
-    Val *alternative = alt_list->first;
-    return evaluate(alternative, env);
+    vm.stack[vm.count++] = v;
+    return 1;
 }
 
-// (macro) [quote expr]
-Val *quote_func(Val *args, Val *env)
+
+static Val *vmPop(void) { return vm.stack[--vm.count]; }
+
+
+// Drop the stack down to `base`
+static void vmUnwind(size_t base)
 {
-    (void)env;
-    Val *err;
-    if (!argsIsMatchForm("v", args, &err)) { return valCreateError(err); }
-    return valCopy(args->first);
+    while (vm.count > base) { valFreeRec(vmPop()); }
 }
 
-// (macro) [do (expr)...]
-Val *do_func(Val *args, Val *env)
+
+static Val *vmRun(LizpCode *code, size_t base, Val *genv);
+
+
+// Make a frame for a call of the compiled lambda `f` from the `argc`
+// arguments that are on top of the stack
+// Returns non-zero upon success, or pops the arguments and sets *err to the
+// result of the call
+static bool vmFrame(Val *f, size_t argc, Val **err)
 {
-    Val *p = args;
-    Val *e = NULL;
-    while (p && valIsList(p))
+    LizpCode *code = f->closure->body->code;
+    size_t base = vm.count - argc;
+    *err = NULL;
+    if (code->rest? argc < code->params : argc != code->params)
     {
-        e = evaluate(p->first, env);
-        if (valIsError(e)) { return e; } // eval error
-        p = p->rest;
-        if (p) { valFreeRec(e); } // free all values except the last one
+        // arity mismatch, which is not an error value like in ApplyLambda
+        vmUnwind(base);
+        return 0;
     }
-    return e;
+    if (code->rest)
+    {
+        // the rest parameter gets a list of the remaining arguments
+        Val *list = NULL;
+        while (vm.count > base + code->params - 1)
+        {
+            Val *node = valCreateList(vm.stack[vm.count - 1], list);
+            if (!node)
+            {
+                valFreeRec(list);
+                vmUnwind(base);
+                *err = valErrorNoMemory();
+                return 0;
+            }
+            vm.count--;
+            list = node;
+        }
+        vm.stack[vm.count++] = list; // there is room where the arguments were
+    }
+    for (unsigned i = code->params; i < code->locals; i++)
+    {
+        if (!vmPush(NULL))
+        {
+            vmUnwind(base);
+            *err = valErrorNoMemory();
+            return 0;
+        }
+    }
+    if (code->self) { vm.stack[base + code->params] = valShare(f); }
+    // safepoint: the lambda and the frames are reachable from the stack
+    if (gc.enabled && gc.allocated >= gc.threshold) { lizpGcCollect(); }
+    return 1;
 }
 
-// (macro) [and expr1 (expr)...]
-Val *and_func(Val *args, Val *env)
+
+// Call a compiled lambda with the `argc` arguments that are on top of the stack
+static Val *vmEnter(Val *f, size_t argc, Val *genv)
 {
     Val *err;
-    if (!argsIsMatchForm("v&v", args, &err)) { return valCreateError(err); }
-    Val *p = args;
-    while (p && valIsList(p))
+    if (!vmFrame(f, argc, &err)) { return err; }
+    LizpCode *code = f->closure->body->code;
+    return vmRun(code, vm.count - code->locals, genv);
+}
+
+
+// Call a compiled lambda from the tree-walking evaluator
+static Val *vmApply(Val *f, Val *args, Val *env)
+{
+    size_t argc = 0;
+    for (Val *p = args; p && valIsList(p); p = p->rest, argc++)
     {
-        Val *e = evaluate(p->first, env);
-        if (valIsError(e)) { return e; }
-        if (!valIsTrue(e)) { return e; } // item is false
-        p = p->rest;
-        if (!p) { return e; } // last item is true
-        valFreeRec(e);
+        if (!vmPush(valShare(p->first)))
+        {
+            vmUnwind(vm.count - argc);
+            return valErrorNoMemory();
+        }
     }
-    // malformed list
-    return NULL;
+    return vmEnter(f, argc, EnvGlobal(env));
 }
 
-// (macro) [or expr1 (expr)...]
-Val *or_func(Val *args, Val *env)
+
+// Call the function that is below the top `argc` values, and pop them all.
+// The arguments are not checked if the function is the `proven` native.
+static Val *vmCall(size_t argc, const Val *proven, Val *genv)
 {
-    Val *err;
-    if (!argsIsMatchForm("v&v", args, &err)) { return valCreateError(err); }
-    Val *p = args;
-    while (p && valIsList(p))
+    size_t f_index = vm.count - argc - 1;
+    Val *f = vm.stack[f_index];
+    Val *result;
+    Val *body = valIsLambda(f)? f->closure->body : NULL;
+    if (valKind(body) == VK_CODE) { result = vmEnter(f, argc, genv); }
+    else if (valIsFunc(f))
     {
-        Val *e = evaluate(p->first, env);
-        if (valIsError(e)) { return e; }
-        if (valIsTrue(e)) { return e; } // item is true
-        p = p->rest;
-        if (!p) { return e; } // last item is false
-        valFreeRec(e);
+        // natives get a copy of the arguments, because the stack may move
+        // while they run
+        Val *local[LIZP_ARGV_LOCAL];
+        Val **argv = (argc <= LIZP_ARGV_LOCAL)? local : malloc(argc * sizeof(*argv));
+        if (argv)
+        {
+            memcpy(argv, &vm.stack[f_index + 1], argc * sizeof(*argv));
+            result = ApplyNativeV(f, (int)argc, argv, f == proven);
+            for (size_t i = 0; i < argc; i++)
+            {
+                // the function took this argument over
+                if (!argv[i]) { vm.stack[f_index + 1 + i] = NULL; }
+            }
+            if (argv != local) { free(argv); }
+        }
+        else { result = valErrorNoMemory(); }
+        vmUnwind(f_index + 1);
     }
-    // malformed list
-    return NULL;
+    else
+    {
+        // other functions get their arguments as a list
+        Val *args = NULL;
+        while (vm.count > f_index + 1)
+        {
+            Val *node = valCreateList(vm.stack[vm.count - 1], args);
+            if (!node) { break; }
+            vm.count--;
+            args = node;
+        }
+        if (vm.count > f_index + 1)
+        {
+            valFreeRec(args);
+            vmUnwind(f_index + 1);
+            result = valErrorNoMemory();
+        }
+        else
+        {
+            if (gc.enabled) { lizpRootPush(args); }
+            result = Apply(f, args, genv);
+            if (gc.enabled) { lizpRootPop(1); }
+            valFreeRec(args);
+        }
+    }
+    valFreeRec(vmPop());
+    return result;
 }
 
-// (macro) [cond (condition result)...] (no nested lists)
-Val *cond_func(Val *args, Val *env)
+
+// Evaluate a form with the tree-walking evaluator, or create the lambda of
+// a lambda form that a `let` binds to `self`
+static Val *vmEval(const Val *form, const Val *names, const Val *self, size_t base, Val *genv)
 {
-    Val *err;
-    if (!argsIsMatchForm("vv&v", args, &err)) { return valCreateError(err); }
-    unsigned n = valListLength(args);
-    if ((n < 2) || (n % 2))
+    Val *env = valCreateList(NULL, genv);
+    if (!env) { return valErrorNoMemory(); }
+    if (gc.enabled) { lizpRootPush(env); }
+    for (size_t i = base; names; names = names->rest, i++)
     {
-        return valCreateErrorMessage("`cond` requires an even amount of"
-                                " alternating condition expressions and"
-                                " consequence expressions");
+        Val *key = valShare(names->first);
+        Val *val = valShare(vm.stack[i]);
+        if (!key || (vm.stack[i] && !val) || !EnvBind(env, key, val))
+        {
+            valFreeRec(key);
+            valFreeRec(val);
+            EnvFrameEnd(env);
+            return valErrorNoMemory();
+        }
     }
-    Val *p = args;
-    while (p && valIsList(p))
+    Val *result = self? lambdaCreate(form->rest, env, self) : evaluate(form, env);
+    EnvFrameEnd(env);
+    return result;
+}
+
+
+// Run compiled code in the frame that starts at `origin`, and pop the frame
+static Val *vmRun(LizpCode *code, size_t origin, Val *genv)
+{
+    // after a tail call, the callee is kept at origin below its frame
+    size_t base = origin;
+    const int *ops = code->ops;
+    Val **consts = code->consts;
+    size_t pc = 0;
+    while (1)
     {
-        Val *e = evaluate(p->first, env);
-        if (valIsError(e)) { return e; }
-        if (valIsTrue(e))
+        Val *v;
+        switch (ops[pc++])
+        {
+            case OP_NIL:
+                v = NULL;
+                break;
+            case OP_CONST:
+                v = valShare(consts[ops[pc++]]);
+                break;
+            case OP_LOCAL:
+                v = valShare(vm.stack[base + ops[pc++]]);
+                break;
+            case OP_MOVE:
+                v = vm.stack[base + ops[pc]];
+                vm.stack[base + ops[pc++]] = NULL;
+                break;
+            case OP_STORE:
+                {
+                    Val **slot = &vm.stack[base + ops[pc++]];
+                    valFreeRec(*slot);
+                    *slot = vmPop();
+                }
+                continue;
+            case OP_CAPTURED:
+                v = valShare(consts[ops[pc++]]->value);
+                break;
+            case OP_GLOBAL:
+                v = valShare(consts[ops[pc++]]->cell->val);
+                break;
+            case OP_LOOKUP:
+                {
+                    Val *sym = consts[ops[pc++]];
+                    v = EnvGet(genv, sym, &v)? valShare(v) : valCreateErrorUndefined(sym);
+                }
+                break;
+            case OP_POP:
+                valFreeRec(vmPop());
+                continue;
+            case OP_JUMP:
+                pc = ops[pc];
+                continue;
+            case OP_JUMP_FALSE:
+                v = vmPop();
+                pc = valIsTrue(v)? pc + 1 : (size_t)ops[pc];
+                valFreeRec(v);
+                continue;
+            case OP_AND:
+            case OP_OR:
+                if (valIsTrue(vm.stack[vm.count - 1]) == (ops[pc - 1] == OP_OR)) { pc = ops[pc]; }
+                else
+                {
+                    valFreeRec(vmPop());
+                    pc++;
+                }
+                continue;
+            case OP_CALL:
+                v = vmCall(ops[pc], (ops[pc + 1] < 0)? NULL : consts[ops[pc + 1]], genv);
+                pc += 2;
+                break;
+            case OP_TAIL_CALL:
+                {
+                    size_t argc = ops[pc];
+                    int k = ops[pc + 1];
+                    pc += 2;
+                    size_t f_index = vm.count - argc - 1;
+                    Val *f = vm.stack[f_index];
+                    Val *body = valIsLambda(f)? f->closure->body : NULL;
+                    if (valKind(body) != VK_CODE)
+                    {
+                        v = vmCall(argc, (k < 0)? NULL : consts[k], genv);
+                        break;
+                    }
+                    // replace this frame with the callee and its arguments
+                    for (size_t i = origin; i < f_index; i++) { valFreeRec(vm.stack[i]); }
+                    memmove(&vm.stack[origin], &vm.stack[f_index], (argc + 1) * sizeof(*vm.stack));
+                    vm.count = origin + argc + 1;
+                    code = body->code;
+                    if (!vmFrame(f, argc, &v))
+                    {
+                        vmUnwind(origin);
+                        return v;
+                    }
+                    base = origin + 1;
+                    ops = code->ops;
+                    consts = code->consts;
+                    pc = 0;
+                }
+                continue;
+            case OP_EVAL:
+                v = vmEval(consts[ops[pc]], consts[ops[pc] + 1], consts[ops[pc] + 2], base, genv);
+                pc++;
+                break;
+            case OP_RETURN:
+                v = vmPop();
+                vmUnwind(origin);
+                return v;
+            default:
+                assert(0 && "invalid instruction");
+                return NULL;
+        }
+        // an expression was evaluated
+        if (valIsError(v))
         {
-            valFreeRec(e);
-            return evaluate(p->rest->first, env);
+            vmUnwind(origin);
+            return v;
+        }
+        if (!vmPush(v))
+        {
+            vmUnwind(origin);
+            return valErrorNoMemory();
         }
-        valFreeRec(e);
-        p = p->rest;
-        p = p->rest;
     }
-    // no condition matched
-    return NULL;
 }
 
-// (macro) [lambda [(symbol)...] (expr)]
-Val *lambda_func(Val *args, Val *env)
+
+// Make a lambda from the arguments of a lambda form. It sees itself as
+// `self` if that is not NULL, so that a `let` can bind a lambda that calls
+// itself.
+static Val *lambdaCreate(Val *args, Val *env, const Val *self)
 {
-    (void)env;
     Val *err;
     if (!argsIsMatchForm("l(v", args, &err)) { return valCreateError(err); }
     if (!valListLengthIsWithin(args, 2, 2)) { return valCreateErrorMessage("lambda macro requires 2 arguments"); }
@@ -2142,10 +5494,28 @@ Val *lambda_func(Val *args, Val *env)
     // make lambda... with an explicit NULL body if a body is not provided
     Val *body = args->rest;
     if (body) { body = body->first; }
-    return valCreateList(valCreateSymbolStr(const_lambda),
-                    valCreateList(valCopy(params),
-                             valCreateList(valCopy(body),
-                                      NULL)));
+    // a parameter with the same name shadows it, and most lambdas do not
+    // call themselves
+    for (p = params; p && self; p = p->rest)
+    {
+        if (valIsEqual(p->first, self)) { self = NULL; }
+    }
+    if (self && !compileCount(body, self)) { self = NULL; }
+    Val *code = vm.enabled? lizpCompile(params, body, env, self) : NULL;
+    if (!code)
+    {
+        LizpLexical frame = { params, 1, valListLength(params), self, 0, NULL };
+        code = lexicalAnalyze(body, &frame, env);
+        if (body && !code) { return valErrorNoMemory(); }
+    }
+    return closureCreate(valShare(params), code, valShare(self));
+}
+
+
+// (macro) [lambda [(symbol)...] (expr)]
+Val *lambda_func(Val *args, Val *env)
+{
+    return lambdaCreate(args, env, NULL);
 }
 
 
@@ -2344,6 +5714,84 @@ bool argsIsMatchForm(const char *form, const Val *args, Val **err)
     return 1;
 }
 
+
+// Compile a form string (see argsIsMatchForm) into a signature
+// Returns non-zero if the form is valid
+static bool sigCompile(const char *form, LizpSignature *out)
+{
+    LizpSignature sig = { 0, 0, {0} };
+    bool optional = false;
+    for (const char *c = form; *c; c++)
+    {
+        switch (*c)
+        {
+            case '(':
+                // optional marker
+                if (optional) { return 0; }
+                optional = 1;
+                break;
+            case '&':
+                // variadic marker, which must be followed by only a type
+                if (!c[1] || !strchr("vlsLn", c[1]) || c[2]) { return 0; }
+                sig.types[sig.count] = c[1];
+                *out = sig;
+                return 1;
+            default:
+                if (!strchr("vlsLn", *c) || sig.count == LIZP_SIG_ARGS) { return 0; }
+                sig.types[sig.count++] = *c;
+                if (!optional) { sig.min++; }
+                break;
+        }
+    }
+    *out = sig;
+    return 1;
+}
+
+
+// Check if the `argc` arguments in `argv` match a compiled signature
+// Sets `err` like argsIsMatchForm() does
+static bool sigIsMatch(const LizpSignature *sig, int argc, Val **argv, Val **err)
+{
+    int i = 0;
+    for (; i < argc && i < sig->count; i++)
+    {
+        if (sig->types[i] != 'v' && !isArgMatch(sig->types[i], argv[i], err))
+        {
+            // wrap message with more context
+            *err = valCreateList(valCreateSymbolStr("argument"),
+                            valCreateList(valCreateInteger(i + 1),
+                                     valCreateList(*err,
+                                              NULL)));
+            return 0;
+        }
+    }
+    if (i < sig->min)
+    {
+        char *arguments = (sig->min == 1)? "argument" : "arguments";
+        *err = valCreateList(valCreateSymbolStr("not enough arguments: requires at least"),
+                        valCreateList(valCreateInteger(sig->min),
+                                 valCreateList(valCreateSymbolStr(arguments),
+                                          NULL)));
+        return 0;
+    }
+    char rest = sig->types[sig->count];
+    if (i < argc && !rest)
+    {
+        char *arguments = (sig->count == 1)? "argument" : "arguments";
+        *err = valCreateList(valCreateSymbolStr("too many arguments, requires at most"),
+                        valCreateList(valCreateInteger(sig->count),
+                                 valCreateList(valCreateSymbolStr(arguments),
+                                          NULL)));
+        return 0;
+    }
+    if (rest == 'v') { return 1; }
+    for (; i < argc; i++)
+    {
+        if (!isArgMatch(rest, argv[i], err)) { return 0; }
+    }
+    return 1;
+}
+
 #endif /* LIZP_IMPLEMENTATION */
 
 /*
@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L // for lizpMapFile()
+
 #include <stdio.h>
 
 #define LIZP_IMPLEMENTATION
@@ -7,14 +9,31 @@
 // Return value:
 // - 0 upon success
 // - non-zero upon failure
-int loadFile(const char *filename, char **text_out, int *len_out)
+int loadFile(const char *filename, const char **text_out, size_t *len_out, bool *mapped_out)
 {
     FILE *fp = fopen(filename, "r");
     if (!fp) { return 1; }
 
+    size_t size;
+    const char *map = lizpMapFile(fp, &size);
+    if (map)
+    {
+        fclose(fp);
+        *text_out = map;
+        *len_out = size;
+        *mapped_out = true;
+        return 0;
+    }
+
     fseek(fp, 0, SEEK_END);
-    int len = ftell(fp);
+    long end = ftell(fp);
     rewind(fp);
+    if (end < 0 || (unsigned long)end >= SIZE_MAX)
+    {
+        fclose(fp);
+        return 1;
+    }
+    size_t len = end;
 
     char *text = malloc(len + 1);
     if (!text)
@@ -29,9 +48,17 @@ int loadFile(const char *filename, char **text_out, int *len_out)
 
     *text_out = text;
     *len_out = len;
+    *mapped_out = false;
     return 0;
 }
 
+// Release the contents from loadFile()
+void unloadFile(const char *text, size_t len, bool mapped)
+{
+    if (mapped) { lizpUnmapFile(text, len); }
+    else { free((char *)text); }
+}
+
 int main(int argc, char **argv)
 {
     if (argc != 2)
@@ -42,9 +69,10 @@ int main(int argc, char **argv)
 
     // load file contents
     char *fname = argv[1];
-    char *text;
-    int length;
-    if (loadFile(fname, &text, &length))
+    const char *text;
+    size_t length;
+    bool mapped;
+    if (loadFile(fname, &text, &length, &mapped))
     {
         perror("fopen");
         return 1;
@@ -52,13 +80,13 @@ int main(int argc, char **argv)
 
     // convert to data structure
     Val *val;
-    int n = valReadAllFromBuffer(text, length, &val);
-    free(text);
+    size_t n = valReadAllFromBuffer(text, length, &val);
+    unloadFile(text, length, mapped);
 
     // print back out
-    text = valWriteToNewString(val, 1);
-    printf("%s\n", text);
-    free(text);
+    char *out = valWriteToNewString(val, 1);
+    printf("%s\n", out);
+    free(out);
 
     return 0;
 }
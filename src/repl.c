@@ -1,5 +1,7 @@
 // Main REPL (read-eval-print loop) program
 
+#define _POSIX_C_SOURCE 200809L // for lizpMapFile()
+
 #define LIZP_IMPLEMENTATION
 #include "lizp.h"
 
@@ -10,6 +12,13 @@
 #define BUF_SZ (2*1024)
 
 
+// whether each read-eval-print cycle allocates from the arena
+static bool use_arena = false;
+
+// whether values are managed by the garbage collector
+static bool use_gc = false;
+
+
 // Print value to a file
 void valWriteToFile(FILE *f, const Val *v, int readable)
 {
@@ -34,110 +43,194 @@ Val *print_func(Val *args)
 
 
 // [defglobal var val]
+// Defining a variable again replaces its value
 Val *defglobal_func(Val *args, Val *env)
 {
     Val *err;
     if (!argsIsMatchForm("sv", args, &err)) { return valCreateError(err); }
-    Val *name = valCopy(args->first);
-    Val *val = valCopy(evaluate(args->rest->first, env));
-    assert(EnvSet(env, name, val));
-    return valCopy(val);
-}
-
-
-// do one read-eval-print cycle on the string
-void rep(const char *str, int len, Val *env)
-{
-    if (!str || !*str || len <= 0) { return; }
-
-    // debug print
-    //printf("\n<str len=%d>%.*s</str>", len, len, str);
-
-    Val *expr = NULL;
-    int n = valReadAllFromBuffer(str, len, &expr);
-    if (valIsError(expr))
+    Val *val = evaluate(args->rest->first, env);
+    if (valIsError(val)) { return val; }
+    Val *result = valCopy(val);
+    if (!EnvSet(EnvGlobal(env), valCopy(args->first), val))
     {
-        putchar('\n');
-        valWriteToFile(stdout, expr, 1);
-        return;
+        valFreeRec(result);
+        return valCreateErrorMessage("could not define a global");
     }
-    if (!n) { return; }
+    return result;
+}
 
-    // wrap multiple expressions in an implicit "do" form
-    if (n > 1)
-    {
-        Val *doo = valCreateSymbolStr("do");
-        expr = valCreateList(doo, expr);
-    }
 
-    // expr is always a value that should be free'd at this point
+// evaluate an expression that was read, and free it
+// Only an error value is printed, unless `print` is set.
+// Returns whether the value was not an error
+bool ep(Val *expr, Val *env, bool print)
+{
+    if (use_arena) { lizpArenaBegin(); }
 
     // debug print
     //putchar('\n');
     //valWriteToFile(stdout, expr, 1);
 
     // Eval
+    if (use_gc) { lizpRootPush(expr); }
     Val *val = evaluate(expr, env);
+    if (use_gc) { lizpRootPop(1); }
 
     // Print
-    putchar('\n');
-    valWriteToFile(stdout, val, 1);
+    bool ok = !valIsError(val);
+    if (print || !ok)
+    {
+        putchar('\n');
+        valWriteToFile(stdout, val, 1);
+    }
 
     valFreeRec(expr);
-    valFree(val);
+    valFreeRec(val);
+    if (use_arena) { lizpArenaEnd(); }
+    return ok;
+}
+
+
+// do one eval-print cycle on the list of expressions read from a line
+void rep(Val *exprs, Val *env)
+{
+    if (!exprs) { return; }
+    Val *expr;
+    if (exprs->rest)
+    {
+        // wrap multiple expressions in an implicit "do" form
+        expr = valCreateList(valCreateSymbolStr("do"), exprs);
+    }
+    else
+    {
+        expr = exprs->first;
+        exprs->first = NULL;
+        valFree(exprs);
+    }
+    ep(expr, env, true);
 }
 
 
 // read, eval, print loop
+// Each line is one cycle. A list may go on over several lines.
 void REPL(Val *env)
 {
     char buffer[BUF_SZ];
-    while (1)
+    LizpReader reader;
+    if (!lizpReaderInit(&reader)) { return; }
+    if (use_gc) { lizpRootPush(reader.hold); }
+    Val *exprs = NULL; // whole expressions read from the line so far
+    Val **tail = &exprs;
+    printf("\n>>> ");
+    while (!reader.end)
     {
         // Read
-        printf("\n>>> ");
-        if (!fgets(buffer, sizeof(buffer), stdin))
+        size_t len = 0;
+        if (fgets(buffer, sizeof(buffer), stdin)) { len = strlen(buffer); }
+        // A line that does not fit into the buffer is read in pieces.
+        // Only the last line of the input may lack a newline.
+        bool piece = len == sizeof(buffer) - 1 && buffer[len - 1] != '\n';
+        lizpReaderFeed(&reader, buffer, len);
+        if (!len || (!piece && buffer[len - 1] != '\n')) { lizpReaderEnd(&reader); }
+        Val *expr;
+        bool output = false;
+        while (lizpReaderNext(&reader, &expr))
         {
-            break;
+            if (valIsError(expr))
+            {
+                // give up on the rest of the line
+                putchar('\n');
+                valWriteToFile(stdout, expr, 1);
+                valFreeRec(expr);
+                valFreeRec(exprs);
+                exprs = NULL;
+                tail = &exprs;
+                output = true;
+                break;
+            }
+            *tail = valCreateList(expr, NULL);
+            if (*tail) { tail = &(*tail)->rest; }
         }
-        int len = strlen(buffer);
-        if (len <= 0)
-        {
-            break;
-        }
-        rep(buffer, len, env);
+        if (piece) { continue; }
+        output |= exprs != NULL;
+        rep(exprs, env);
+        exprs = NULL;
+        tail = &exprs;
+        // give memory from a big evaluation back to the system
+        if (use_gc) { lizpGcCollect(); }
+        lizpHeapTrim();
+        if (output || !reader.end) { printf(reader.depth? "\n... " : "\n>>> "); }
     }
+    if (use_gc) { lizpRootPop(1); }
+    lizpReaderFree(&reader);
     printf("end of input\n");
 }
 
 
+// evaluate each expression in a file, and print the value of the last one
 void loadFile(const char *fname, Val *env)
 {
-    // read file contents wrapped in a "do" block
     FILE *f = fopen(fname, "rb");
     if (!f)
     {
         perror("fopen");
         return;
     }
-    fseek(f, 0, SEEK_END);
-    long file_sz = ftell(f);
-    rewind(f);
-    char prelude[] = "[do\n";
-    long buffer_sz = sizeof(prelude) - 1 + file_sz + 2;
-    char *buffer = malloc(buffer_sz);
-    if (!buffer)
+    char buffer[BUF_SZ];
+    LizpReader reader;
+    if (!lizpReaderInit(&reader))
     {
         fclose(f);
         return;
     }
-    fread(buffer + sizeof(prelude) - 1, file_sz, 1, f);
+    if (use_gc) { lizpRootPush(reader.hold); }
+    // a mapped file is read as one chunk, otherwise it is read in pieces
+    size_t map_len = 0;
+    const char *map = lizpMapFile(f, &map_len);
+    // an expression is evaluated once the next one is read, so that the
+    // last one is known
+    Val *last = NULL;
+    bool pending = false;
+    bool ok = true;
+    while (ok && !reader.end)
+    {
+        if (map)
+        {
+            lizpReaderFeed(&reader, map, map_len);
+            lizpReaderEnd(&reader);
+        }
+        else
+        {
+            size_t len = fread(buffer, 1, sizeof(buffer), f);
+            lizpReaderFeed(&reader, buffer, len);
+            if (!len) { lizpReaderEnd(&reader); }
+        }
+        Val *expr;
+        while (ok && lizpReaderNext(&reader, &expr))
+        {
+            if (pending)
+            {
+                if (use_gc) { lizpRootPush(expr); }
+                ok = ep(last, env, false);
+                if (use_gc) { lizpRootPop(1); }
+            }
+            last = expr;
+            pending = !valIsError(expr);
+            if (ok && !pending)
+            {
+                // stop at a syntax error
+                putchar('\n');
+                valWriteToFile(stdout, expr, 1);
+                ok = false;
+            }
+        }
+    }
+    lizpUnmapFile(map, map_len);
     fclose(f);
-    memcpy(buffer, prelude, sizeof(prelude) - 1);
-    buffer[buffer_sz - 2] = ']';
-    buffer[buffer_sz - 1] = 0;
-    rep(buffer, buffer_sz, env);
-    free(buffer);
+    if (ok && pending) { ep(last, env, true); }
+    else { valFreeRec(last); }
+    if (use_gc) { lizpRootPop(1); }
+    lizpReaderFree(&reader);
 }
 
 int main (int argc, char **argv)
@@ -145,13 +238,33 @@ int main (int argc, char **argv)
     // init environment
     Val *env = valCreateList(NULL, NULL);
     lizpRegisterCore(env);
-    EnvSetFunc(env, "print", print_func);
+    EnvSetFunc(env, "print", NULL, print_func);
     EnvSetMacro(env, "defglobal", defglobal_func);
     EnvSetSym(env, "#f", valCreateFalse());
     EnvSetSym(env, "#t", valCreateTrue());
     // load each file given on the command line
     for (int i = 1; i < argc; i++)
     {
+        if (!strcmp(argv[i], "-a"))
+        {
+            // allocate each read-eval-print cycle from an arena
+            use_arena = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-g"))
+        {
+            // use the garbage collector instead of freeing values
+            use_gc = true;
+            lizpGcEnable();
+            lizpRootPush(env);
+            continue;
+        }
+        if (!strcmp(argv[i], "-c"))
+        {
+            // compile lambdas to bytecode
+            lizpVmEnable();
+            continue;
+        }
         printf("loading %s\n", argv[i]);
         loadFile(argv[i], env);
     }
@@ -0,0 +1,398 @@
+// Behavior tests of evaluation, which should pass with each engine:
+// run with no option, with -g for the garbage collector, and with -c for the
+// bytecode compiler.
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define LIZP_IMPLEMENTATION
+#include "lizp.h"
+
+static Val *env;
+static bool use_gc;
+
+// Evaluate each expression in some text
+// Return value: the last value, which the caller frees
+static Val *EvalText(const char *text)
+{
+    LizpReader reader;
+    if (!lizpReaderInit(&reader)) { return NULL; }
+    if (use_gc) { lizpRootPush(reader.hold); }
+    lizpReaderFeed(&reader, text, strlen(text));
+    lizpReaderEnd(&reader);
+    Val *val = NULL;
+    Val *expr;
+    while (lizpReaderNext(&reader, &expr))
+    {
+        valFreeRec(val);
+        if (use_gc) { lizpRootPush(expr); }
+        val = evaluate(expr, env);
+        if (use_gc) { lizpRootPop(1); }
+        valFreeRec(expr);
+    }
+    if (use_gc) { lizpRootPop(1); }
+    lizpReaderFree(&reader);
+    return val;
+}
+
+// Check that the last value of some text prints as `expect`
+static void Expect(const char *text, const char *expect)
+{
+    Val *val = EvalText(text);
+    char *s = valWriteToNewString(val, 1);
+    if (strcmp(s, expect))
+    {
+        fprintf(stderr, "%s\n  gives %s\n  instead of %s\n", text, s, expect);
+        assert(0);
+    }
+    free(s);
+    valFreeRec(val);
+}
+
+// Bind a global to the value of an expression
+static void Define(const char *name, const char *text)
+{
+    Val *val = EvalText(text);
+    assert(!valIsError(val));
+    assert(EnvSet(env, valCreateSymbolStr(name), val));
+}
+
+static void TestForms(void)
+{
+    // each engine gives the same values for the core forms
+    Expect("[[^ [x] [quote [x y]]] 1]", "[x y]");
+    Expect("[[^ [x] [cond [= x 1] 10 [= x 2] 20]] 2]", "20");
+    Expect("[[^ [x] [cond [= x 1] 10 [= x 2] 20]] 3]", "[]");
+    Expect("[[^ [x] [if x 1]] [list]]", "[]");
+    Expect("[[^ [x] [list [and 1 x 3] [or [list] x]]] 2]", "[3 2]");
+    Expect("[[^ [x] [let [y [+ x 1] z [* y 2]] [list x y z]]] 1]", "[1 2 4]");
+    Expect("[[^ [l] [list [length l] [nth 1 l] [prepend 0 l] [append 4 l] [slice l 1]]] [list 1 2 3]]",
+            "[3 2 [0 1 2 3] [1 2 3 4] [2 3]]");
+    Expect("[[^ [f x] [f [f x]]] [^ [n] [* n n]] 3]", "81");
+    // integers that are not in their written form stay symbols
+    Expect("[[^ [x] [list x [quote 007] [quote -0] [- x x]]] 12]", "[12 007 -0 0]");
+    // rest parameters and arity mismatches
+    Expect("[[^ [a &r] [list a &r]] 1 2 3]", "[1 [2 3]]");
+    Expect("[[^ [a b] a] 1]", "[]");
+    // errors
+    Expect("[[^ [x] [undefined-thing x]] 1]", "[error undefined-thing \"is undefined\"]");
+    Expect("[[^ [x] [+ x [quote a]]] 1]", "[error \"should be a symbol for an integer\"]");
+}
+
+static void TestNestedLambda(void)
+{
+    // inner lambdas see the parameters of every lambda around them
+    Define("mk", "[^ [a] [^ [b] [^ [c] [list a b c]]]]");
+    Expect("[[[mk 1] 2] 3]", "[1 2 3]");
+    Expect("[let [x 1] [[[^ [] [^ [] x]]]]]", "1");
+    Define("adder", "[^ [a] [let [b 10] [^ [c] [+ a b c]]]]");
+    Expect("[[adder 1] 2]", "13");
+    // captured by value when created
+    Expect("[let [x 1 f [^ [] x]] [let [x 2] [f]]]", "1");
+}
+
+static void TestLetSelf(void)
+{
+    // a lambda that a let binds can call itself by that name
+    Expect("[let [f [^ [n] [if [= n 0] 0 [f [- n 1]]]]] [f 3]]", "0");
+    Define("count-to", "[^ [m] [let [loop [^ [i acc] [if [= i 0] acc [loop [- i 1] [+ acc m]]]]] [loop 4 0]]]");
+    Expect("[count-to 5]", "20");
+    Expect("[let [f [^ [n] [if [= n 0] [list] [prepend n [[^ [k] [f k]] [- n 1]]]]]] [f 3]]", "[3 2 1]");
+    // unless a parameter has the same name
+    Expect("[let [f [^ [f] f]] [f 5]]", "5");
+}
+
+static void TestLexicalScope(void)
+{
+    // a lambda does not see the variables of its caller
+    Define("get-y", "[^ [] y]");
+    Expect("[let [y 7] [get-y]]", "[error y \"is undefined\"]");
+    // but sees globals that are defined after it
+    Define("get-z", "[^ [] z]");
+    Define("z", "8");
+    Expect("[get-z]", "8");
+}
+
+static void TestSet(void)
+{
+    Define("g", "1");
+    Expect("[set! g 2]", "2");
+    Expect("g", "2");
+    // lambdas see a global that is set or defined again
+    Define("bump", "[^ [] [set! g [+ g 1]]]");
+    Define("get-g", "[^ [] g]");
+    Expect("[do [bump] [bump] [get-g]]", "4");
+    Define("g", "10");
+    Expect("[do [bump] [get-g]]", "11");
+    // the nearest binding changes
+    Expect("[let [x 1] [do [set! x 5] x]]", "5");
+    Expect("[let [x 1] [let [x 2] [do [set! x 9] x]]]", "9");
+    Expect("[let [x 1] [do [let [x 2] [set! x 9]] x]]", "1");
+    Expect("[[^ [a] [do [set! a [+ a 1]] a]] 4]", "5");
+    Expect("[[^ [a] [let [b a] [do [set! b 0] [list a b]]]] 4]", "[4 0]");
+    Expect("[set! nope 3]", "[error nope \"is undefined\"]");
+}
+
+static void TestTailCall(void)
+{
+    // these would run out of C stack if each call nested
+    Define("loop", "[^ [n acc] [if [= n 0] acc [loop [- n 1] [+ acc 1]]]]");
+    Expect("[loop 100000 0]", "100000");
+    Define("even?", "[^ [n] [cond [= n 0] #t #t [odd? [- n 1]]]]");
+    Define("odd?", "[^ [n] [if [= n 0] [list] [let [m [- n 1]] [do [even? m]]]]]");
+    Expect("[even? 100001]", "[]");
+    Expect("[let [f [^ [n] [and #t [or [= n 0] [f [- n 1]]]]]] [f 100000]]", "#t");
+}
+
+static void TestErrors(void)
+{
+    // a list that looks like an error is plain data
+    Define("e", "[quote [error \"x\"]]");
+    Val *val = EvalText("e");
+    assert(val && !valIsError(val));
+    valFreeRec(val);
+    Expect("[list 1 e 2]", "[1 [error x] 2]");
+    Expect("[length e]", "2");
+    Expect("[if e 1 2]", "1");
+    Expect("[[^ [x] [list x [length x]]] e]", "[[error x] 2]");
+    Expect("[let [y [quote [error y]]] [do y 3]]", "3");
+    // and a real error stops evaluation wherever it is made
+    val = EvalText("[nope]");
+    assert(valIsError(val));
+    valFreeRec(val);
+    Expect("[list 1 [nope] 2]", "[error nope \"is undefined\"]");
+    Expect("[length [+ 1 [quote a]]]", "[error \"should be a symbol for an integer\"]");
+    Expect("[[^ [x] [do [nope x] 3]] 1]", "[error nope \"is undefined\"]");
+    Expect("[let [y [nope]] 3]", "[error nope \"is undefined\"]");
+}
+
+static void TestShared(void)
+{
+    // natives only take over a list that nothing else holds
+    Define("l", "[list 1 2 3]");
+    Define("l2", "l");
+    Expect("[append 4 l2]", "[1 2 3 4]");
+    Expect("[without 2 l2]", "[1 3]");
+    Expect("[prepend 0 l2]", "[0 1 2 3]");
+    Expect("[slice l2 1]", "[2 3]");
+    Expect("[list l l2]", "[[1 2 3] [1 2 3]]");
+    Expect("[let [m l] [list [append 4 m] [without 1 m] m l]]", "[[1 2 3 4] [2 3] [1 2 3] [1 2 3]]");
+    Expect("[[^ [m] [list [append 4 m] m]] l]", "[[1 2 3 4] [1 2 3]]");
+    // a list that is shared from its middle
+    Expect("[let [a [list 1 2 3] b [slice a 1]] [list [append 4 b] [without 3 a] a b]]",
+            "[[2 3 4] [1 2] [1 2 3] [2 3]]");
+    // and a list that is not shared is taken over
+    Expect("[append 4 [without 2 [list 1 2 3]]]", "[1 3 4]");
+}
+
+static void TestArena(void)
+{
+    // globals that are defined or set in an arena cycle outlive it
+    Define("kept", "1");
+    lizpArenaBegin();
+    Define("arena-l", "[list 1 [quote \"a b\"] [list 2 [quote c]]]");
+    Define("arena-f", "[^ [x] [list x arena-l]]");
+    Expect("[set! kept [list kept [arena-f 2]]]", "[1 [2 [1 \"a b\" [2 c]]]]");
+    lizpArenaEnd();
+    // and another cycle that reuses the arena does not change them
+    lizpArenaBegin();
+    Expect("[list 9 9 9 9 9 9 9 9 9 9 9 9 [quote \"x y\"] [quote \"z w\"]]",
+            "[9 9 9 9 9 9 9 9 9 9 9 9 \"x y\" \"z w\"]");
+    lizpArenaEnd();
+    Expect("arena-l", "[1 \"a b\" [2 c]]");
+    Expect("[arena-f 3]", "[3 [1 \"a b\" [2 c]]]");
+    Expect("kept", "[1 [2 [1 \"a b\" [2 c]]]]");
+}
+
+static void TestShareMany(void)
+{
+    // a value that is shared more times than its count holds is copied
+    Define("many", "[list 1 [quote \"a b\"] [list 2]]");
+    Val *val = EvalText("many");
+    Val *held[600];
+    for (int i = 0; i < 600; i++)
+    {
+        held[i] = valShare(val);
+        assert(held[i] && valIsEqual(held[i], val));
+    }
+    if (!use_gc) { assert(held[599] != val); }
+    for (int i = 0; i < 600; i++) { valFreeRec(held[i]); }
+    valFreeRec(val);
+    // as is one that evaluation shares
+    char text[2048] = "[list";
+    for (int i = 0; i < 300; i++) { strcat(text, " many"); }
+    strcat(text, "]");
+    val = EvalText(text);
+    assert(valListLength(val) == 300);
+    for (Val *p = val; p; p = p->rest) { assert(valIsEqual(p->first, val->first)); }
+    valFreeRec(val);
+    Expect("[let [m many] [append 3 m]]", "[1 \"a b\" [2] 3]");
+    Expect("many", "[1 \"a b\" [2]]");
+    // each share was given back
+    val = EvalText("many");
+    if (!use_gc) { assert(*valRefs(val) == 1); }
+    valFreeRec(val);
+}
+
+static void TestManyBindings(void)
+{
+    // more bindings than a scope keeps in a list
+    Expect("[let [a 1 b 2 c 3 d 4 e 5 f 6 g 7 h 8 i 9 j 10 a 11] [list a b c d e f g h i j]]",
+            "[11 2 3 4 5 6 7 8 9 10]");
+    Expect("[let [a 1 b 2 c 3 d 4 e 5 f 6 g 7 h 8 i 9 j 10]"
+            " [do [set! a 0] [set! e 0] [set! j 0] [let [b 20 i 90] [set! b 21]] [list a b c d e f g h i j]]]",
+            "[0 2 3 4 0 6 7 8 9 0]");
+    Define("ten", "[^ [a b c d e f g h i j] [do [set! j [+ a j]] [let [a 0 k 11] [list a b c d e f g h i j k]]]]");
+    Expect("[ten 1 2 3 4 5 6 7 8 9 10]", "[0 2 3 4 5 6 7 8 9 11 11]");
+
+    // a local scope that switches to a hash table
+    Val *global = env;
+    char name[16];
+    env = valCreateList(NULL, global);
+    if (use_gc) { lizpRootPush(env); }
+    for (int i = 0; i < 12; i++)
+    {
+        snprintf(name, sizeof(name), "v%d", i);
+        assert(EnvSet(env, valCreateSymbolStr(name), valCreateInteger(i)));
+    }
+    assert(EnvSet(env, valCreateSymbolStr("v0"), valCreateInteger(100)));
+    assert(valKind(env->first) == VK_SCOPE);
+    Expect("[list v0 v1 v2 v3 v4 v5 v6 v7 v8 v9 v10 v11]", "[100 1 2 3 4 5 6 7 8 9 10 11]");
+    Expect("[do [set! v1 [+ v1 v11]] [set! v11 0] [list v1 v11]]", "[12 0]");
+    Expect("[let [v2 20] [do [set! v2 21] [list v2 v3]]]", "[21 3]");
+    Expect("[list v2 [[^ [v3] [list v3 v4]] 30] [let [f [^ [] v5]] [f]]]", "[2 [30 4] 5]");
+    if (use_gc) { lizpRootPop(1); }
+    env->rest = NULL;
+    valFreeRec(env);
+    env = global;
+
+    // references to globals still hold after the global table grows
+    Define("gv", "1");
+    Define("get-gv", "[^ [] gv]");
+    Define("set-gv", "[^ [x] [set! gv x]]");
+    for (int i = 0; i < 1000; i++)
+    {
+        snprintf(name, sizeof(name), "g%d", i);
+        assert(EnvSet(env, valCreateSymbolStr(name), valCreateInteger(i)));
+    }
+    Expect("[get-gv]", "1");
+    Expect("[do [set-gv 2] [list gv [get-gv] g0 g999]]", "[2 2 0 999]");
+}
+
+// A native that returns its argument list
+static Val *args_func(Val *args)
+{
+    return valCopy(args);
+}
+
+static void TestSignatures(void)
+{
+    // too few and too many arguments
+    Expect("[/ 1]", "[error \"not enough arguments: requires at least\" 2 arguments]");
+    Expect("[empty?]", "[error \"not enough arguments: requires at least\" 1 argument]");
+    Expect("[-]", "[error \"not enough arguments: requires at least\" 1 argument]");
+    Expect("[/ 1 2 3]", "[error \"too many arguments, requires at most\" 2 arguments]");
+    Expect("[- 1 2 3]", "[error \"too many arguments, requires at most\" 2 arguments]");
+    Expect("[empty? 1 2]", "[error \"too many arguments, requires at most\" 1 argument]");
+    // the wrong kind is numbered by argument, not by place in the form
+    Expect("[- [list]]", "[error argument 1 \"should be a symbol for an integer\"]");
+    Expect("[- 1 [quote a]]", "[error argument 2 \"should be a symbol for an integer\"]");
+    Expect("[member? 1 2]", "[error argument 2 \"should be a list\"]");
+    // the rest of the arguments
+    Expect("[+ 1 2 [quote a]]", "[error \"should be a symbol for an integer\"]");
+    Expect("[< 1]", "[error \"not enough arguments: requires at least\" 2 arguments]");
+    Expect("[< 1 2 [list]]", "[error \"should be a symbol for an integer\"]");
+    Expect("[= 1 [list] [quote a]]", "[]");
+
+    // a native with optional arguments and a rest
+    assert(EnvSetFunc(env, "f-sLn", "s(L&n", args_func));
+    Expect("[f-sLn [quote a]]", "[a]");
+    Expect("[f-sLn [quote a] [list 1]]", "[a [1]]");
+    Expect("[f-sLn [quote a] [list 1] 2 3]", "[a [1] 2 3]");
+    Expect("[f-sLn]", "[error \"not enough arguments: requires at least\" 1 argument]");
+    Expect("[f-sLn [list]]", "[error argument 1 \"should be a symbol\"]");
+    Expect("[f-sLn [quote a] [list]]", "[error argument 2 \"should be a non-empty list\"]");
+    Expect("[f-sLn [quote a] [list 1] 2 [quote b]]", "[error \"should be a symbol for an integer\"]");
+    assert(EnvSetFunc(env, "f-all", NULL, args_func));
+    Expect("[f-all]", "[]");
+    Expect("[f-all 1 [list] [quote a]]", "[1 [] a]");
+    // and when it is called through a parameter
+    Expect("[[^ [g] [g [quote a] 2]] f-sLn]", "[error argument 2 \"should be a non-empty list\"]");
+
+    // forms that are not valid
+    assert(!EnvSetFunc(env, "bad", "x", args_func));
+    assert(!EnvSetFunc(env, "bad", "n(n(n", args_func));
+    assert(!EnvSetFunc(env, "bad", "n&", args_func));
+    assert(!EnvSetFunc(env, "bad", "n&nn", args_func));
+    assert(!EnvSetFunc(env, "bad", "&x", args_func));
+    Expect("[bad]", "[error bad \"is undefined\"]");
+}
+
+// Check that writing the last value of some text to a buffer that is too
+// short writes the start of it, and nothing past the end of the buffer
+static void ExpectWriteCut(const char *text)
+{
+    Val *val = EvalText(text);
+    char *s = valWriteToNewString(val, 1);
+    size_t len = strlen(s);
+    char buf[256];
+    assert(len < sizeof(buf));
+    for (size_t n = 0; n <= len; n++)
+    {
+        memset(buf, '#', sizeof(buf));
+        assert(valWriteToBuffer(val, buf, n, 1) == len);
+        assert(!memcmp(buf, s, n));
+        assert(buf[n] == '#');
+    }
+    free(s);
+    valFreeRec(val);
+}
+
+static void TestWrite(void)
+{
+    Expect("[^ [x] [list x x]]", "[lambda [x] [list x x]]");
+    ExpectWriteCut("[^ [x] [list x x]]");
+    ExpectWriteCut("[list [^ [] [quote \"a b\"]] 12]");
+    ExpectWriteCut("+");
+    ExpectWriteCut("[list + [list +]]");
+    ExpectWriteCut("let");
+}
+
+static void Test(void)
+{
+    TestForms();
+    TestNestedLambda();
+    TestLetSelf();
+    TestLexicalScope();
+    TestSet();
+    TestTailCall();
+    TestErrors();
+    TestShared();
+    TestManyBindings();
+    TestArena();
+    TestShareMany();
+    TestSignatures();
+    TestWrite();
+}
+
+int main(int argc, char **argv)
+{
+    env = valCreateList(NULL, NULL);
+    lizpRegisterCore(env);
+    EnvSetSym(env, "#t", valCreateTrue());
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-g"))
+        {
+            use_gc = true;
+            lizpGcEnable();
+            lizpRootPush(env);
+        }
+        else if (!strcmp(argv[i], "-c")) { lizpVmEnable(); }
+    }
+    fprintf(stderr, "Testing...\n");
+    Test();
+    fprintf(stderr, "Testing succeeded.\n");
+    return 0;
+}
@@ -0,0 +1,397 @@
+// Behavior tests of the reader
+#define _POSIX_C_SOURCE 200809L // for lizpMapFile() and mmap()
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define LIZP_IMPLEMENTATION
+#include "lizp.h"
+
+// Read all of the values from some chunks of input, which end at a NULL
+// Return value: the values and errors that were read, printed and separated
+// by spaces
+static char *ReadChunks(const char **chunks)
+{
+    static char out[4096];
+    size_t n = 0;
+    out[0] = 0;
+    LizpReader r;
+    assert(lizpReaderInit(&r));
+    for (; *chunks; chunks++)
+    {
+        lizpReaderFeed(&r, *chunks, strlen(*chunks));
+        if (!chunks[1]) { lizpReaderEnd(&r); }
+        Val *v;
+        while (lizpReaderNext(&r, &v))
+        {
+            char *s = valWriteToNewString(v, 1);
+            n += snprintf(out + n, sizeof(out) - n, n? " %s" : "%s", s);
+            assert(n < sizeof(out));
+            free(s);
+            valFreeRec(v);
+        }
+    }
+    lizpReaderFree(&r);
+    return out;
+}
+
+// Check what some chunks of input read as
+static void Expect(const char **chunks, const char *expect)
+{
+    const char *s = ReadChunks(chunks);
+    if (strcmp(s, expect))
+    {
+        fprintf(stderr, "read %s\n  instead of %s\n", s, expect);
+        assert(0);
+    }
+}
+
+static void TestReadBlank(void)
+{
+    // no values, and no error
+    Expect((const char *[]){ "", NULL }, "");
+    Expect((const char *[]){ "  \n\t ", NULL }, "");
+    Expect((const char *[]){ " (just a comment) ", NULL }, "");
+    Expect((const char *[]){ " ", "", " ", NULL }, "");
+    // but one value was asked for
+    Val *v = NULL;
+    valReadOneFromBuffer("  ", 2, &v);
+    assert(valIsError(v));
+    valFreeRec(v);
+}
+
+static void TestReadUnclosed(void)
+{
+    Expect((const char *[]){ "[a b", NULL }, "[error \"reached an unexpected end of input\"]");
+    Expect((const char *[]){ "[a [b c]", NULL }, "[error \"reached an unexpected end of input\"]");
+    Expect((const char *[]){ "\"abc", NULL }, "[error \"read an unterminated string\"]");
+    Expect((const char *[]){ "a]", NULL }, "a [error \"read an unexpected ']'\"]");
+    // the reader goes on after an error
+    Expect((const char *[]){ "] b", NULL }, "[error \"read an unexpected ']'\"] b");
+    Val *v = NULL;
+    assert(valReadAllFromBuffer("x [y", 4, &v) == 1);
+    assert(valIsError(v));
+    valFreeRec(v);
+}
+
+static void TestReadChunks(void)
+{
+    // values and tokens can be cut off anywhere
+    Expect((const char *[]){ "[ab", "c \"d", " e\" 1", "2]", NULL }, "[abc \"d e\" 12]");
+    Expect((const char *[]){ "[a", "", "]", " b", NULL }, "[a] b");
+    Expect((const char *[]){ "[a", "", NULL }, "[error \"reached an unexpected end of input\"]");
+    Expect((const char *[]){ "x", "y", NULL }, "xy");
+}
+
+// Check whether some text reads as one native integer, and that it is
+// written back as the same text
+static void ExpectInteger(const char *text, bool integer)
+{
+    Val *v = NULL;
+    assert(valReadOneFromBuffer(text, strlen(text), &v) == strlen(text));
+    if ((valKind(v) == VK_INT) != integer)
+    {
+        fprintf(stderr, "%s should%s read as an integer\n", text, integer? "" : " not");
+        assert(0);
+    }
+    assert(valIsSymbol(v));
+    char *s = valWriteToNewString(v, 1);
+    assert(!strcmp(s, text));
+    free(s);
+    // the same as a symbol that is made from the text
+    Val *sym = valCreateSymbolStr(text);
+    assert(valIsEqual(v, sym));
+    valFreeRec(sym);
+    valFreeRec(v);
+}
+
+static void TestReadIntegers(void)
+{
+    // only the form that an integer is written in
+    const char *ints[] = { "0", "7", "-7", "12", "-1000", "40000000000" };
+    const char *syms[] = { "007", "-0", "00", "+5", "-", "--1", "1a", "-x", "1-", "0x10" };
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) { ExpectInteger(ints[i], 1); }
+    for (size_t i = 0; i < sizeof(syms) / sizeof(syms[0]); i++) { ExpectInteger(syms[i], 0); }
+    // the limits of a long, and just past them
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%ld", LONG_MAX);
+    ExpectInteger(buf, 1);
+    snprintf(buf, sizeof(buf), "%ld", LONG_MIN);
+    ExpectInteger(buf, 1);
+    snprintf(buf, sizeof(buf), "%lu", (unsigned long)LONG_MAX + 1);
+    ExpectInteger(buf, 0);
+    snprintf(buf, sizeof(buf), "-%lu", (unsigned long)LONG_MAX + 2);
+    ExpectInteger(buf, 0);
+    snprintf(buf, sizeof(buf), "%lu0", (unsigned long)LONG_MAX);
+    ExpectInteger(buf, 0);
+    // and in a list
+    Expect((const char *[]){ "[1 007 -0 -12]", NULL }, "[1 007 -0 -12]");
+}
+
+// The scan that the reader uses gives the same answer as the one that looks
+// at one character at a time, wherever the character it stops at falls
+// within or across the blocks of 16 or 32 characters
+static void TestReadScan(void)
+{
+    const struct { const ReadSet *set; const char *stops; } sets[] = {
+        { &read_delims, " []()\"\t\n\v\f\r" },
+        { &read_quoted, "\n\"\\" },
+        { &read_comments, "()" },
+    };
+    char s[128];
+    for (size_t k = 0; k < sizeof(sets) / sizeof(sets[0]); k++)
+    {
+        // a null character, which is not in the strings above, stops them all
+        const char *stops = sets[k].stops;
+        for (size_t c = 0; c <= strlen(stops); c++)
+        {
+            for (size_t i = 0; i < 4; i++)
+            {
+                for (size_t d = 0; d < 70; d++)
+                {
+                    size_t n = i + d + 1 + (d % 3) * 10;
+                    memset(s, 'a', sizeof(s));
+                    s[i + d] = stops[c];
+                    assert(readScan(s, i, n, sets[k].set) == i + d);
+                    assert(readScanBytes(s, i, n, sets[k].set) == i + d);
+                    // the first one counts when there are more
+                    s[i + d + 1 + d % 5] = stops[0];
+                    assert(readScan(s, i, n + 6, sets[k].set) == i + d);
+                    s[i + d + 1 + d % 5] = 'a';
+                    // and when the character is not there
+                    s[i + d] = 'a';
+                    assert(readScan(s, i, n, sets[k].set) == n);
+                }
+            }
+        }
+    }
+}
+
+// Symbols, quoted symbols and comments that end near the edges of the
+// blocks that are scanned at once, read whole and cut into two chunks
+static void TestReadTokens(void)
+{
+    const size_t lengths[] = { 1, 2, 14, 15, 16, 17, 18, 30, 31, 32, 33, 34, 47, 48, 49, 63, 64, 65 };
+    char text[128], expect[128], name[80];
+    for (size_t k = 0; k < sizeof(lengths) / sizeof(lengths[0]); k++)
+    {
+        size_t len = lengths[k];
+        for (int kind = 0; kind < 3; kind++)
+        {
+            for (size_t pad = 0; pad < 3; pad++)
+            {
+                memset(name, kind == 2? 'c' : 'b', len);
+                name[len] = 0;
+                if (kind == 0)
+                {
+                    snprintf(text, sizeof(text), "%*s[%s]", (int)pad, "", name);
+                    snprintf(expect, sizeof(expect), "[%s]", name);
+                }
+                else if (kind == 1)
+                {
+                    // the space makes it print with quotes
+                    name[len / 2] = ' ';
+                    snprintf(text, sizeof(text), "%*s\"%s\"", (int)pad, "", name);
+                    snprintf(expect, sizeof(expect), "\"%s\"", name);
+                }
+                else
+                {
+                    snprintf(text, sizeof(text), "%*s(%s) x", (int)pad, "", name);
+                    snprintf(expect, sizeof(expect), "x");
+                }
+                Expect((const char *[]){ text, NULL }, expect);
+                char a[128];
+                for (size_t cut = 0; cut <= strlen(text); cut++)
+                {
+                    memcpy(a, text, cut);
+                    a[cut] = 0;
+                    Expect((const char *[]){ a, text + cut, NULL }, expect);
+                }
+            }
+        }
+    }
+}
+
+// Read some text with lists nested `depth` deep from a reader that allows
+// `max_depth` open lists
+// Return value: whether it read a value that is not an error
+static bool ReadNested(size_t depth, size_t max_depth)
+{
+    char *text = malloc(2 * depth + 2);
+    assert(text);
+    memset(text, '[', depth);
+    text[depth] = 'x';
+    memset(text + depth + 1, ']', depth);
+    text[2 * depth + 1] = 0;
+    LizpReader r;
+    assert(lizpReaderInit(&r));
+    r.max_depth = max_depth;
+    lizpReaderFeed(&r, text, 2 * depth + 1);
+    lizpReaderEnd(&r);
+    Val *v;
+    assert(lizpReaderNext(&r, &v));
+    bool ok = !valIsError(v);
+    if (ok)
+    {
+        // the other functions that go through a whole value handle it too
+        Val *copy = valCopy(v);
+        assert(valIsEqual(v, copy));
+        assert(valWriteToBuffer(copy, NULL, 0, 1) == 2 * depth + 1);
+        valFreeRec(copy);
+    }
+    valFreeRec(v);
+    // after an error, the reader goes on with the rest of the input
+    while (lizpReaderNext(&r, &v)) { valFreeRec(v); }
+    lizpReaderFree(&r);
+    free(text);
+    return ok;
+}
+
+static void TestReadDepth(void)
+{
+    assert(ReadNested(3, 3));
+    assert(!ReadNested(4, 3));
+    Expect((const char *[]){ "[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[", NULL },
+            "[error \"reached an unexpected end of input\"]");
+    assert(ReadNested(LIZP_READ_DEPTH, LIZP_READ_DEPTH));
+    assert(!ReadNested(LIZP_READ_DEPTH + 1, LIZP_READ_DEPTH));
+}
+
+#ifdef LIZP_MMAP
+
+#define HUGE_BLOCK ((size_t)1 << 20)
+
+// Make a temporary file of some blocks of text
+// Return value: the file, or NULL if it could not be made
+static FILE *BlocksFile(const char **blocks, size_t n)
+{
+    FILE *f = tmpfile();
+    if (!f) { return NULL; }
+    char *b = malloc(HUGE_BLOCK);
+    assert(b);
+    for (size_t i = 0; i < n; i++)
+    {
+        memset(b, 'x', HUGE_BLOCK);
+        memcpy(b, blocks[i], strlen(blocks[i]));
+        if (fwrite(b, 1, HUGE_BLOCK, f) != HUGE_BLOCK)
+        {
+            fclose(f);
+            f = NULL;
+            break;
+        }
+    }
+    free(b);
+    if (f) { fflush(f); }
+    return f;
+}
+
+#endif /* LIZP_MMAP */
+
+
+// Input and output past 4 GiB, which is skipped where it can't be mapped
+static void TestReadHuge(void)
+{
+#ifdef LIZP_MMAP
+    if (SIZE_MAX <= UINT_MAX) { return; }
+    // a sparse file is mapped whole
+    const size_t huge = (size_t)UINT_MAX + 16;
+    FILE *f = tmpfile();
+    if (f && fputs("[a b]", f) >= 0 && !fseek(f, (long)huge - 1, SEEK_SET) && fputc(']', f) == ']')
+    {
+        fflush(f);
+        size_t len = 0;
+        const char *map = lizpMapFile(f, &len);
+        if (map)
+        {
+            assert(len == huge);
+            assert(map[len - 1] == ']');
+            Val *v = NULL;
+            assert(valReadOneFromBuffer(map, len, &v) == 5);
+            assert(valListLength(v) == 2);
+            valFreeRec(v);
+            lizpUnmapFile(map, len);
+        }
+    }
+    if (f) { fclose(f); }
+
+    // a comment of 4 GiB that is made of one block mapped over and over,
+    // followed by a value that is read in the same chunk
+    const size_t count = (size_t)UINT_MAX / HUGE_BLOCK + 2;
+    const char *blocks[] = { "(", "", ") [abc \"d e\" 123] " };
+    f = BlocksFile(blocks, 3);
+    char *base = f? mmap(NULL, count * HUGE_BLOCK, PROT_NONE, MAP_PRIVATE, fileno(f), 0) : MAP_FAILED;
+    bool ok = base != MAP_FAILED;
+    for (size_t i = 0; ok && i < count; i++)
+    {
+        off_t block = (i == 0)? 0 : (i < count - 1)? 1 : 2;
+        void *p = mmap(base + i * HUGE_BLOCK, HUGE_BLOCK, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+                fileno(f), block * HUGE_BLOCK);
+        ok = p != MAP_FAILED;
+    }
+    if (ok)
+    {
+        LizpReader r;
+        assert(lizpReaderInit(&r));
+        lizpReaderFeed(&r, base, count * HUGE_BLOCK);
+        lizpReaderEnd(&r);
+        Val *v;
+        assert(lizpReaderNext(&r, &v));
+        assert(r.pos > UINT_MAX);
+        char *s = valWriteToNewString(v, 1);
+        assert(!strcmp(s, "[abc \"d e\" 123]"));
+        free(s);
+        valFreeRec(v);
+        // the rest of the last block is one long symbol
+        assert(lizpReaderNext(&r, &v));
+        assert(valWriteToBuffer(v, NULL, 0, 1) == HUGE_BLOCK - strlen(blocks[2]));
+        valFreeRec(v);
+        assert(!lizpReaderNext(&r, &v));
+        lizpReaderFree(&r);
+    }
+    if (base != MAP_FAILED) { munmap(base, count * HUGE_BLOCK); }
+    if (f) { fclose(f); }
+#endif /* LIZP_MMAP */
+
+    // a value that is written as more than 4 GiB of text: a list nested 12
+    // deep, with 4096 shared copies of a 1 MiB symbol at the bottom
+    char *name = malloc(HUGE_BLOCK + 1);
+    assert(name);
+    memset(name, 'a', HUGE_BLOCK);
+    Val *v = valCreateSymbolCopy(name, HUGE_BLOCK);
+    free(name);
+    assert(v);
+    size_t len = HUGE_BLOCK;
+    for (int i = 0; i < 12; i++)
+    {
+        v = valCreateList(valShare(v), valCreateList(v, NULL));
+        assert(v && v->rest);
+        len = 2 * len + 3;
+    }
+    if (SIZE_MAX > UINT_MAX) { assert(len > UINT_MAX); }
+    assert(valWriteToBuffer(v, NULL, 0, 0) == len);
+    char buf[32];
+    assert(valWriteToBuffer(v, buf, sizeof(buf), 0) == len);
+    assert(!memcmp(buf, "[[[[[[[[[[[[aaaaaaaaaaaaaaaaaaaa", sizeof(buf)));
+    valFreeRec(v);
+}
+
+static void Test(void)
+{
+    TestReadBlank();
+    TestReadUnclosed();
+    TestReadChunks();
+    TestReadIntegers();
+    TestReadScan();
+    TestReadTokens();
+    TestReadDepth();
+    TestReadHuge();
+}
+
+int main(void)
+{
+    fprintf(stderr, "Testing...\n");
+    Test();
+    fprintf(stderr, "Testing succeeded.\n");
+    return 0;
+}